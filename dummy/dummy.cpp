@@ -1,10 +1,51 @@
 #ifndef DUMMY
 #define DUMMY
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <new>
 
 #include <mpi.h>
 
+/* allocation */
+
+// The local arrays are aligned to a cache line, which covers any vector width
+// up to AVX-512 too. It's done by hand on top of plain new so allocation
+// tracking still sees them, the pointer new handed out is kept right in front
+// of the aligned block for delete_aligned().
+static const size_t array_alignment = 64;
+
+template<typename real>
+real* new_aligned(int n)
+{
+  char* raw = static_cast<char*>(
+  ::operator new(n * sizeof(real) + sizeof(void*) + array_alignment - 1));
+  uintptr_t start = reinterpret_cast<uintptr_t>(raw + sizeof(void*));
+  char* aligned   = raw + sizeof(void*) +
+                  (array_alignment - start % array_alignment) % array_alignment;
+  memcpy(aligned - sizeof(void*), &raw, sizeof(raw));
+  return reinterpret_cast<real*>(aligned);
+}
+
+template<typename real>
+void delete_aligned(real* ptr)
+{
+  if (!ptr)
+    return;
+
+  void* raw;
+  memcpy(&raw, reinterpret_cast<char*>(ptr) - sizeof(void*), sizeof(raw));
+  ::operator delete(raw);
+}
+
+template<typename real>
+bool is_aligned(const real* ptr)
+{
+  return reinterpret_cast<uintptr_t>(ptr) % array_alignment == 0;
+}
+
 template<typename real>
 struct arrays
 {
@@ -13,6 +54,8 @@ struct arrays
   MPI_Comm comm;
   MPI_Datatype type;
   int n_local;
+  int offset;  // global index of a_local[0]
+  bool owns_inputs;
   real* a_local;
   real* b_local;
   real* c_local;
@@ -39,6 +82,19 @@ arrays<int> init(int foo)
   return arr;
 }
 
+// Which part of the "n" global elements ends up on "rank", the first n % size
+// ranks get one extra so nobody holds more than one element above the rest.
+inline void partition(int n, int rank, int size, int* n_local, int* offset)
+{
+  int base  = n / size;
+  int extra = n % size;
+  *n_local  = base + (rank < extra ? 1 : 0);
+  *offset   = rank * base + (rank < extra ? rank : extra);
+}
+
+// Distributes "a" and "b" from rank 0, they only need to exist there (the
+// other ranks can pass nullptr) so no rank but the root ever holds more than
+// its own slice.
 template<typename real>
 arrays<real> setup(MPI_Comm comm, real* a, real* b, int n)
 {
@@ -50,77 +106,243 @@ arrays<real> setup(MPI_Comm comm, real* a, real* b, int n)
 
   /* now we need to split the arrays */
 
-  if (n % size != 0 && rank == 0)
+  state.comm        = comm;
+  state.rank        = rank;
+  state.size        = size;
+  state.owns_inputs = true;
+  partition(n, rank, size, &state.n_local, &state.offset);
+  state.a_local = new_aligned<real>(state.n_local);
+  state.b_local = new_aligned<real>(state.n_local);
+  state.c_local = new_aligned<real>(state.n_local);
+
+  // the even split doesn't need the counts and displacements spelled out
+  if (n % size == 0)
   {
-    printf("choose an array size that divides evenly!");
-    MPI_Abort(comm, 1);
+    MPI_Scatter(a,
+                state.n_local,
+                state.type,
+                state.a_local,
+                state.n_local,
+                state.type,
+                0,
+                comm);
+    MPI_Scatter(b,
+                state.n_local,
+                state.type,
+                state.b_local,
+                state.n_local,
+                state.type,
+                0,
+                comm);
+    return state;
   }
-  MPI_Barrier(comm);
-
-  state.comm    = comm;
-  state.rank    = rank;
-  state.size    = size;
-  state.n_local = n / size;
-  state.a_local = new real[state.n_local];
-  state.b_local = new real[state.n_local];
-  state.c_local = new real[state.n_local];
-
-  int offset = rank * state.n_local;
-  for (int i = 0; i < state.n_local; ++i)
+
+  int* counts = nullptr;
+  int* displs = nullptr;
+  if (rank == 0)
   {
-    state.a_local[i] = a[i + offset];
-    state.b_local[i] = b[i + offset];
+    counts = new int[2 * size];
+    displs = counts + size;
+    for (int r = 0; r < size; ++r)
+      partition(n, r, size, counts + r, displs + r);
   }
 
+  MPI_Scatterv(a,
+               counts,
+               displs,
+               state.type,
+               state.a_local,
+               state.n_local,
+               state.type,
+               0,
+               comm);
+  MPI_Scatterv(b,
+               counts,
+               displs,
+               state.type,
+               state.b_local,
+               state.n_local,
+               state.type,
+               0,
+               comm);
+
+  delete[] counts;
+  return state;
+}
+
+// For when every rank already has its own slices of "a" and "b" (of any
+// size), they're used as they are without copying and stay owned by the
+// caller. Only the output gets allocated.
+template<typename real>
+arrays<real>
+setup_in_place(MPI_Comm comm, real* a_local, real* b_local, int n_local)
+{
+  arrays<real> state = init((real)42);
+
+  MPI_Comm_rank(comm, &state.rank);
+  MPI_Comm_size(comm, &state.size);
+  state.comm        = comm;
+  state.owns_inputs = false;
+  state.n_local     = n_local;
+  state.a_local     = a_local;
+  state.b_local     = b_local;
+  state.c_local     = new_aligned<real>(n_local);
+
+  // rank 0's result is undefined
+  state.offset = 0;
+  MPI_Exscan(&n_local, &state.offset, 1, MPI_INT, MPI_SUM, comm);
+  if (state.rank == 0)
+    state.offset = 0;
+
   return state;
 }
 
 template<typename real>
 void clean(arrays<real>* state)
 {
-  delete[] state->a_local;
-  delete[] state->b_local;
-  delete[] state->c_local;
+  if (state->owns_inputs)
+  {
+    delete_aligned(state->a_local);
+    delete_aligned(state->b_local);
+  }
+  delete_aligned(state->c_local);
 }
 
+/* output */
+
+// Up to this many elements print() just gathers everything on rank 0, past
+// that it streams rank by rank through a buffer of "print_chunk" elements so
+// rank 0 never holds more than that no matter how big the global array is.
+static const int print_gather_limit = 1 << 12;
+static const int print_chunk        = 1 << 10;
+
 template<typename real>
-void print(arrays<real>* state)
+void print_values(const real* values, int n)
 {
-  /* now we output (it's brain time) */
+  for (int i = 0; i < n; ++i)
+    std::cout << values[i] << " ";
+}
+
+template<typename real>
+void print_gathered(arrays<real>* state, int n)
+{
+  int* counts = nullptr;
+  int* displs = nullptr;
+  real* c     = nullptr;
+  if (state->rank == 0)
+  {
+    counts = new int[2 * state->size];
+    displs = counts + state->size;
+    c      = new real[n];
+  }
+
+  MPI_Gather(
+  &state->n_local, 1, MPI_INT, counts, 1, MPI_INT, 0, state->comm);
+  if (state->rank == 0)
+  {
+    displs[0] = 0;
+    for (int r = 1; r < state->size; ++r)
+      displs[r] = displs[r - 1] + counts[r - 1];
+  }
 
-  MPI_Request request;
-  MPI_Issend(state->c_local,
-             state->n_local,
-             state->type,
-             0,
-             state->rank,
-             state->comm,
-             &request);
+  MPI_Gatherv(state->c_local,
+              state->n_local,
+              state->type,
+              c,
+              counts,
+              displs,
+              state->type,
+              0,
+              state->comm);
 
   if (state->rank == 0)
   {
-    int n   = state->n_local * state->size;
-    real* c = new real[n];
-    for (int r = 0; r < state->size; ++r)  // receiving from each rank
+    print_values(c, n);
+    std::cout << "\n";
+  }
+
+  delete[] counts;
+  delete[] c;
+}
+
+// Rank 0 asks every other rank for its slice in turn (so nothing piles up in
+// front of it) and they send it over in chunks. A chunk shorter than
+// "print_chunk" is the last one, which can mean an empty one at the end.
+template<typename real>
+void print_streamed(arrays<real>* state)
+{
+  if (state->rank != 0)
+  {
+    MPI_Recv(nullptr, 0, MPI_INT, 0, 0, state->comm, MPI_STATUS_IGNORE);
+    for (int i = 0;; i += print_chunk)
     {
-      MPI_Status status;
-      MPI_Recv(c + state->n_local * r,
-               state->n_local,
-               state->type,
-               r,
-               r,
-               state->comm,
-               &status);
+      int n = std::min(print_chunk, state->n_local - i);
+      MPI_Send(state->c_local + i, n, state->type, 0, 0, state->comm);
+      if (n < print_chunk)
+        break;
     }
-    for (int i = 0; i < n; ++i)
-      std::cout << c[i] << " ";
-    std::cout << "\n";
+    return;
+  }
+
+  print_values(state->c_local, state->n_local);
 
-    delete[] c;
+  real buffer[print_chunk];
+  for (int r = 1; r < state->size; ++r)  // receiving from each rank
+  {
+    MPI_Send(nullptr, 0, MPI_INT, r, 0, state->comm);
+
+    int n = print_chunk;
+    while (n == print_chunk)
+    {
+      MPI_Status status;
+      MPI_Recv(buffer, print_chunk, state->type, r, 0, state->comm, &status);
+      MPI_Get_count(&status, state->type, &n);
+      print_values(buffer, n);
+    }
   }
+  std::cout << "\n";
+}
+
+template<typename real>
+void print(arrays<real>* state)
+{
+  /* now we output (it's brain time) */
+
+  int n;
+  MPI_Allreduce(&state->n_local, &n, 1, MPI_INT, MPI_SUM, state->comm);
+
+  if (n <= print_gather_limit)
+    print_gathered(state, n);
+  else
+    print_streamed(state);
+}
+
+// Writes c as raw binary to "path" through MPI-IO, every rank writes its own
+// slice at its own offset so it never goes through rank 0 at all. Returns
+// the MPI error code (files default to returning errors instead of aborting).
+template<typename real>
+int write_binary(arrays<real>* state, const char* path)
+{
+  MPI_File file;
+  int err = MPI_File_open(state->comm,
+                          path,
+                          MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                          MPI_INFO_NULL,
+                          &file);
+  if (err != MPI_SUCCESS)
+    return err;
+
+  err = MPI_File_set_size(file, 0);
+  if (err == MPI_SUCCESS)
+    err = MPI_File_write_at_all(file,
+                                (MPI_Offset)state->offset * sizeof(real),
+                                state->c_local,
+                                state->n_local,
+                                state->type,
+                                MPI_STATUS_IGNORE);
 
-  MPI_Status status;
-  MPI_Wait(&request, &status);
+  MPI_File_close(&file);
+  return err;
 }
 
 template<typename real>
@@ -137,4 +359,116 @@ void sub(arrays<real>* state)
     state->c_local[i] = state->a_local[i] - state->b_local[i];
 }
 
+/* vectorized and threaded kernels */
+
+// Same as add and sub but written so the compiler can vectorize them without
+// any runtime checks: the arrays never alias and (when they came from
+// setup()) are aligned. The threaded versions split the loop with OpenMP
+// when it's enabled (see OPENMP in the Makefile) and are just the
+// vectorized ones otherwise.
+
+#if defined(__GNUC__)
+#define DUMMY_RESTRICT __restrict__
+#define DUMMY_ASSUME_ALIGNED(ptr) \
+  ptr = static_cast<decltype(ptr)>(  \
+  __builtin_assume_aligned(ptr, array_alignment))
+#else
+#define DUMMY_RESTRICT
+#define DUMMY_ASSUME_ALIGNED(ptr)
+#endif
+
+struct add_op
+{
+  template<typename real>
+  static real apply(real a, real b)
+  {
+    return a + b;
+  }
+};
+
+struct sub_op
+{
+  template<typename real>
+  static real apply(real a, real b)
+  {
+    return a - b;
+  }
+};
+
+template<typename op, typename real>
+void simd_kernel(const real* DUMMY_RESTRICT a,
+                 const real* DUMMY_RESTRICT b,
+                 real* DUMMY_RESTRICT c,
+                 int n)
+{
+#pragma omp simd
+  for (int i = 0; i < n; ++i)
+    c[i] = op::apply(a[i], b[i]);
+}
+
+template<typename op, typename real>
+void simd_kernel_aligned(const real* DUMMY_RESTRICT a,
+                         const real* DUMMY_RESTRICT b,
+                         real* DUMMY_RESTRICT c,
+                         int n)
+{
+  DUMMY_ASSUME_ALIGNED(a);
+  DUMMY_ASSUME_ALIGNED(b);
+  DUMMY_ASSUME_ALIGNED(c);
+#pragma omp simd
+  for (int i = 0; i < n; ++i)
+    c[i] = op::apply(a[i], b[i]);
+}
+
+template<typename op, typename real>
+void threaded_kernel(const real* DUMMY_RESTRICT a,
+                     const real* DUMMY_RESTRICT b,
+                     real* DUMMY_RESTRICT c,
+                     int n)
+{
+#pragma omp parallel for simd
+  for (int i = 0; i < n; ++i)
+    c[i] = op::apply(a[i], b[i]);
+}
+
+// setup_in_place() takes whatever the caller has so the alignment gets
+// checked instead of assumed
+template<typename op, typename real>
+void apply_simd(arrays<real>* state)
+{
+  if (is_aligned(state->a_local) && is_aligned(state->b_local) &&
+      is_aligned(state->c_local))
+    simd_kernel_aligned<op>(
+    state->a_local, state->b_local, state->c_local, state->n_local);
+  else
+    simd_kernel<op>(
+    state->a_local, state->b_local, state->c_local, state->n_local);
+}
+
+template<typename real>
+void add_simd(arrays<real>* state)
+{
+  apply_simd<add_op>(state);
+}
+
+template<typename real>
+void sub_simd(arrays<real>* state)
+{
+  apply_simd<sub_op>(state);
+}
+
+template<typename real>
+void add_threaded(arrays<real>* state)
+{
+  threaded_kernel<add_op>(
+  state->a_local, state->b_local, state->c_local, state->n_local);
+}
+
+template<typename real>
+void sub_threaded(arrays<real>* state)
+{
+  threaded_kernel<sub_op>(
+  state->a_local, state->b_local, state->c_local, state->n_local);
+}
+
 #endif
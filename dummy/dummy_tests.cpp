@@ -1,4 +1,9 @@
 #include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
 
 #include "mpitest.h"
 
@@ -92,6 +97,349 @@ TEST(float_add_test, 2)
   clean(&state);
 }
 
+TEST(array_sub_test, 2)
+{
+  int_fixture data;
+  arrays<int> state = setup(comm, data.a, data.b, data.n);
+  sub(&state);
+
+  int expected[] = {1, 1, 1, 1};
+  ASSERT_EQ(state.n_local, 4);
+  EXPECT_ARRAY_EQ(state.c_local, expected, state.n_local);
+
+  clean(&state);
+}
+
+TEST(float_array_add_test, 1, 2)
+{
+  float_fixture data;
+  arrays<float> state = setup(comm, data.a, data.b, data.n);
+  add(&state);
+
+  float expected[] = {0.1, 0.3, 0.5, 0.7, 0.9, 1.1, 1.3, 1.5};
+  EXPECT_FLOAT_ARRAY_EQ(
+  state.c_local, expected + state.rank * state.n_local, state.n_local, 10);
+
+  clean(&state);
+}
+
+TEST(dist_float_add_test, 2, 4)
+{
+  float_fixture data;
+  arrays<float> state = setup(comm, data.a, data.b, data.n);
+  add(&state);
+
+  ASSERT_ALL(comm, state.n_local > 0);
+  EXPECT_DIST_ARRAY_EQ(
+  comm,
+  state.c_local,
+  state.n_local,
+  [](unsigned long long i) { return 0.1f * (2 * i + 1); },
+  10);
+
+  clean(&state);
+}
+
+TEST(add_alloc_test, 2)
+{
+  int_fixture data;
+  arrays<int> state;
+  ASSERT_MAX_ALLOCATIONS(3, state = setup(comm, data.a, data.b, data.n));
+  EXPECT_MAX_ALLOCATIONS(0, add(&state));
+
+  clean(&state);
+}
+
+TEST(uneven_setup_test, 3)
+{
+  // only the root needs the global arrays
+  int_fixture data;
+  int* a = nullptr;
+  int* b = nullptr;
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  if (rank == 0)
+  {
+    a = data.a;
+    b = data.b;
+  }
+
+  arrays<int> state = setup(comm, a, b, data.n);
+  add(&state);
+
+  // 8 elements on 3 procs split 3, 3, 2
+  ASSERT_EQ(state.n_local, state.rank < 2 ? 3 : 2);
+  ASSERT_EQ(state.offset, 3 * state.rank);
+  for (int i = 0; i < state.n_local; ++i)
+    EXPECT_EQ(state.c_local[i], 2 * (state.offset + i) + 1);
+
+  clean(&state);
+}
+
+TEST(in_place_setup_test, 2, 4)
+{
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  std::vector<int> a(rank + 1, rank), b(rank + 1, 1);
+
+  // nothing but the output gets allocated
+  arrays<int> state;
+  ASSERT_MAX_ALLOCATIONS(
+  1, state = setup_in_place(comm, a.data(), b.data(), rank + 1));
+  sub(&state);
+
+  ASSERT_EQ(state.a_local, a.data());
+  ASSERT_EQ(state.offset, rank * (rank + 1) / 2);
+  std::vector<int> expected(rank + 1, rank - 1);
+  EXPECT_ARRAY_EQ(state.c_local, expected.data(), state.n_local);
+
+  clean(&state);
+}
+
+TEST_PLACEMENT(print_comm_test, mpi_test::placement_both, 2, 4)
+{
+  int_fixture data;
+  arrays<int> state = setup(comm, data.a, data.b, data.n);
+  add(&state);
+
+  // small outputs only take collectives
+  EXPECT_MAX_MESSAGES(0, print(&state));
+
+  clean(&state);
+}
+
+TEST(print_streamed_test, 3)
+{
+  int_fixture data;
+  arrays<int> state = setup(comm, data.a, data.b, data.n);
+  add(&state);
+
+  // rank 0 sends a ready message to both the others, they each send back a
+  // single (short) chunk (and that's a single print, checked both ways)
+  EXPECT_MAX_ALLOCATIONS(0, EXPECT_MAX_MESSAGES(2, print_streamed(&state)));
+
+  clean(&state);
+}
+
+TEST(write_binary_test, 2)
+{
+  int_fixture data;
+  arrays<int> state = setup(comm, data.a, data.b, data.n);
+  add(&state);
+
+  // Named after the pid of rank 0 so runs sharing a machine (and its
+  // P_tmpdir) don't write over each other's files.
+  int pid = (int)getpid();
+  MPI_Bcast(&pid, 1, MPI_INT, 0, comm);
+  std::string path = std::string(P_tmpdir) + "/mpitest_dummy_binary_" +
+                     std::to_string(pid) + ".bin";
+  ASSERT_ALL(comm, write_binary(&state, path.c_str()) == MPI_SUCCESS);
+
+  if (state.rank == 0)
+  {
+    int c[data.n];
+    size_t num_read = 0;
+    FILE* file      = fopen(path.c_str(), "rb");
+    if (file)
+    {
+      num_read = fread(c, sizeof(int), data.n, file);
+      fclose(file);
+    }
+    MPI_File_delete(path.c_str(), MPI_INFO_NULL);
+
+    ASSERT_TRUE(file != nullptr);
+    ASSERT_EQ(num_read, (size_t)data.n);
+
+    int expected[] = {1, 3, 5, 7, 9, 11, 13, 15};
+    EXPECT_ARRAY_EQ(c, expected, data.n);
+  }
+}
+
+// The vectorized and threaded kernels have to agree exactly with the plain
+// loops, it's the same arithmetic on every element.
+template<typename real>
+void check_kernels(MPI_Comm comm)
+{
+  const int n = 1001;  // not a multiple of any vector width
+  std::vector<real> a, b;
+  int rank;
+  MPI_Comm_rank(comm, &rank);
+  if (rank == 0)
+  {
+    for (int i = 0; i < n; ++i)
+    {
+      a.push_back((real)i / 4);
+      b.push_back((real)(n - i) / 3);
+    }
+  }
+
+  arrays<real> state = setup(comm, a.data(), b.data(), n);
+  ASSERT_TRUE(is_aligned(state.a_local) && is_aligned(state.c_local));
+
+  std::vector<real> expected(state.n_local);
+  add(&state);
+  std::copy(state.c_local, state.c_local + state.n_local, expected.begin());
+  add_simd(&state);
+  EXPECT_ARRAY_EQ(state.c_local, expected.data(), state.n_local);
+  add_threaded(&state);
+  EXPECT_ARRAY_EQ(state.c_local, expected.data(), state.n_local);
+
+  sub(&state);
+  std::copy(state.c_local, state.c_local + state.n_local, expected.begin());
+  sub_simd(&state);
+  EXPECT_ARRAY_EQ(state.c_local, expected.data(), state.n_local);
+  sub_threaded(&state);
+  EXPECT_ARRAY_EQ(state.c_local, expected.data(), state.n_local);
+
+  clean(&state);
+}
+
+TEST(kernels_test, 1, 3)
+{
+  check_kernels<int>(comm);
+  check_kernels<float>(comm);
+  check_kernels<double>(comm);
+}
+
+// the unaligned path, nothing here is on a 64 byte boundary
+TEST(unaligned_kernels_test, 2)
+{
+  std::vector<double> storage(3 * 101 + 3, 1.);
+  double* a = storage.data() + 1;
+  double* b = a + 101;
+  double* c = b + 102;
+
+  arrays<double> state = setup_in_place(comm, a, b, 101);
+  double* own_c        = state.c_local;
+  state.c_local        = c;
+  add_simd(&state);
+
+  std::vector<double> expected(101, 2.);
+  EXPECT_ARRAY_EQ(c, expected.data(), 101);
+
+  // hand clean() back the output it allocated
+  state.c_local = own_c;
+  clean(&state);
+}
+
+// Every thread adds up its own part of the arrays, there's no MPI in here so
+// this works at any thread level.
+TEST_THREADS(threaded_add_test, 4, 1, 2)
+{
+  int_fixture data;
+  int chunk = data.n / num_threads;
+
+  arrays<int> state = init(0);
+  std::vector<int> c(chunk);
+  state.n_local = chunk;
+  state.a_local = data.a + thread * chunk;
+  state.b_local = data.b + thread * chunk;
+  state.c_local = c.data();
+  add_simd(&state);
+
+  for (int i = 0; i < chunk; ++i)
+    EXPECT_EQ(c[i], 2 * (thread * chunk + i) + 1);
+}
+
+/* suite fixtures */
+
+// Split once per communicator shape and then shared (read only) by all the
+// TEST_Fs below, each test just computes into its own output array.
+struct int_suite
+{
+  int_fixture data;
+  arrays<int> state;
+
+  int_suite(MPI_Comm comm) : state(setup(comm, data.a, data.b, data.n))
+  {
+  }
+
+  ~int_suite()
+  {
+    clean(&state);
+  }
+};
+
+TEST_F(suite_add_test, int_suite, 2, 4)
+{
+  arrays<int> state = fixture.state;
+  std::vector<int> c(state.n_local);
+  state.c_local = c.data();
+  add(&state);
+
+  for (int i = 0; i < state.n_local; ++i)
+    EXPECT_EQ(state.c_local[i], 2 * (state.offset + i) + 1);
+}
+
+TEST_F(suite_sub_test, int_suite, 2, 4)
+{
+  arrays<int> state = fixture.state;
+  std::vector<int> c(state.n_local);
+  state.c_local = c.data();
+  sub(&state);
+
+  std::vector<int> expected(state.n_local, 1);
+  EXPECT_ARRAY_EQ(state.c_local, expected.data(), state.n_local);
+}
+
+/* benchmarks */
+
+BENCHMARK_STRONG_SCALING(add_bench, 1, 2, 4)
+{
+  const int n = 1 << 16;
+  std::vector<double> a(n, 1.), b(n, 2.);
+  arrays<double> state = setup(comm, a.data(), b.data(), n);
+  add(&state);
+  clean(&state);
+}
+
+// The inputs for the kernel benchmarks, split once per type and shape so the
+// benchmarks only ever time the kernels.
+template<typename real>
+struct kernel_suite
+{
+  static const int n    = 1 << 18;
+  static const int reps = 16;
+  arrays<real> state;
+
+  kernel_suite(MPI_Comm comm) : state(split(comm))
+  {
+  }
+
+  ~kernel_suite()
+  {
+    clean(&state);
+  }
+
+  static arrays<real> split(MPI_Comm comm)
+  {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    std::vector<real> a(rank == 0 ? n : 0, 1);
+    std::vector<real> b(rank == 0 ? n : 0, 2);
+    return setup(comm, a.data(), b.data(), n);
+  }
+};
+
+// scalar, vectorized and threaded kernels side by side for every type
+#define KERNEL_BENCHMARK(name, real, kernel)                 \
+  BENCHMARK_F(name, kernel_suite<real>, 1, 4)                \
+  {                                                          \
+    arrays<real> state = fixture.state;                      \
+    for (int i = 0; i < kernel_suite<real>::reps; ++i)       \
+      kernel(&state);                                        \
+  }
+
+KERNEL_BENCHMARK(add_int_bench, int, add)
+KERNEL_BENCHMARK(add_int_simd_bench, int, add_simd)
+KERNEL_BENCHMARK(add_int_threaded_bench, int, add_threaded)
+KERNEL_BENCHMARK(add_float_bench, float, add)
+KERNEL_BENCHMARK(add_float_simd_bench, float, add_simd)
+KERNEL_BENCHMARK(add_float_threaded_bench, float, add_threaded)
+KERNEL_BENCHMARK(add_double_bench, double, add)
+KERNEL_BENCHMARK(add_double_simd_bench, double, add_simd)
+KERNEL_BENCHMARK(add_double_threaded_bench, double, add_threaded)
+
 /* some random serial tests that don't do much */
 
 TEST(serial_add, 1)
@@ -0,0 +1,145 @@
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "mpitest.h"
+
+// The allocation tracking layer, this lives in its own library
+// (lib/libmpitest_alloc.a) since replacing the global operator new and delete
+// isn't something every program wants. Link it after libmpitest, whatever
+// calls new makes the linker pull all of this in and the runner starts
+// counting the heap usage of every test. Every block gets a small header in
+// front of it holding its size, that way delete knows how many bytes just
+// stopped being live. It's kept at the alignment malloc guarantees so the
+// pointer handed out is just as aligned as it would have been without the
+// header. The counters themselves live in mpitest.cpp (see
+// "count_allocation"), which also gets the final say on whether a block counts
+// at all.
+
+namespace
+{
+  // Lets the runner know it's been linked in during dynamic initialization,
+  // just like the PMPI layer.
+  struct alloc_layer
+  {
+    alloc_layer()
+    {
+      mpi_test::link_alloc_tracking();
+    }
+  };
+
+  alloc_layer the_alloc_layer;
+
+  // The header holds the size of the block and whether it was counted (the
+  // runner's own allocations aren't).
+  const size_t alloc_header = alignof(std::max_align_t);
+  static_assert(alloc_header >= sizeof(size_t) + sizeof(bool),
+                "the allocation header doesn't fit");
+
+  void* tracked_malloc(size_t size)
+  {
+    // Too big to fit the header in front, which is the same as malloc
+    // failing (so new ends up throwing std::bad_alloc).
+    if (size > SIZE_MAX - alloc_header)
+      return nullptr;
+
+    char* block = static_cast<char*>(malloc(alloc_header + size));
+    if (!block)
+      return nullptr;
+    bool counted = mpi_test::count_allocation(size);
+    memcpy(block, &size, sizeof(size));
+    memcpy(block + sizeof(size), &counted, sizeof(counted));
+    return block + alloc_header;
+  }
+
+  void tracked_free(void* ptr)
+  {
+    if (!ptr)
+      return;
+
+    char* block = static_cast<char*>(ptr) - alloc_header;
+    size_t size;
+    bool counted;
+    memcpy(&size, block, sizeof(size));
+    memcpy(&counted, block + sizeof(size), sizeof(counted));
+    if (counted)
+      mpi_test::count_free(size);
+    free(block);
+  }
+
+  // The standard new, which keeps calling the new handler (if there is one)
+  // until the allocation works.
+  void* tracked_new(size_t size)
+  {
+    for (;;)
+    {
+      void* ptr = tracked_malloc(size);
+      if (ptr)
+        return ptr;
+
+      std::new_handler handler = std::get_new_handler();
+      if (!handler)
+        throw std::bad_alloc();
+      handler();
+    }
+  }
+
+}  // namespace
+
+/* the replacements */
+
+void* operator new(std::size_t size)
+{
+  return tracked_new(size);
+}
+
+void* operator new[](std::size_t size)
+{
+  return tracked_new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return tracked_new(size);
+  }
+  catch (...)
+  {
+    return nullptr;
+  }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return tracked_new(size);
+  }
+  catch (...)
+  {
+    return nullptr;
+  }
+}
+
+void operator delete(void* ptr) noexcept
+{
+  tracked_free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+  tracked_free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+  tracked_free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+  tracked_free(ptr);
+}
@@ -0,0 +1,146 @@
+#include <vector>
+
+#include <mpi.h>
+
+#include "mpitest.h"
+
+// The calibration suite, a handful of MPI microbenchmarks that only run with
+// --calibrate (and then before anything else) so the benchmark numbers of a
+// job can be read against how the machine behaved during that same job. The
+// runner refers to "link_calibration" so this always gets linked in along
+// with it. Every body does a single operation, the runner's warmup and
+// iterations take care of the repetition. The collectives run at every size
+// "world_sizes" stands for, so the full size of the job is always in there.
+
+namespace mpi_test
+{
+  void link_calibration()
+  {
+  }
+
+}  // namespace mpi_test
+
+namespace
+{
+  // Buffers for the bodies, kept around between runs so the timings aren't
+  // all page faults.
+  std::vector<char>& scratch(int which, size_t bytes)
+  {
+    static std::vector<char> buffers[2];
+    if (buffers[which].size() < bytes)
+      buffers[which].resize(bytes);
+    return buffers[which];
+  }
+
+  // One round trip of "bytes" between the two procs of "comm".
+  void pingpong(MPI_Comm comm, int bytes)
+  {
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    char* buff = scratch(0, bytes).data();
+
+    if (rank == 0)
+    {
+      MPI_Send(buff, bytes, MPI_CHAR, 1, 0, comm);
+      MPI_Recv(buff, bytes, MPI_CHAR, 1, 0, comm, MPI_STATUS_IGNORE);
+    }
+    else
+    {
+      MPI_Recv(buff, bytes, MPI_CHAR, 0, 0, comm, MPI_STATUS_IGNORE);
+      MPI_Send(buff, bytes, MPI_CHAR, 0, 0, comm);
+    }
+  }
+
+  void allreduce(MPI_Comm comm, int count)
+  {
+    double* send = reinterpret_cast<double*>(
+    scratch(0, count * sizeof(double)).data());
+    double* recv = reinterpret_cast<double*>(
+    scratch(1, count * sizeof(double)).data());
+    MPI_Allreduce(send, recv, count, MPI_DOUBLE, MPI_SUM, comm);
+  }
+
+}  // namespace
+
+/* point to point */
+
+// Both placements, so there's a number for within a node and one across
+// nodes. The bytes are counted both ways.
+
+CALIBRATION(calibrate_pingpong_8,
+            mpi_test::scaling_none,
+            mpi_test::placement_both,
+            2. * 8,
+            2)
+{
+  pingpong(comm, 8);
+}
+
+CALIBRATION(calibrate_pingpong_64k,
+            mpi_test::scaling_none,
+            mpi_test::placement_both,
+            2. * (1 << 16),
+            2)
+{
+  pingpong(comm, 1 << 16);
+}
+
+CALIBRATION(calibrate_pingpong_4m,
+            mpi_test::scaling_none,
+            mpi_test::placement_both,
+            2. * (1 << 22),
+            2)
+{
+  pingpong(comm, 1 << 22);
+}
+
+/* collectives */
+
+// Weak scaling (every proc contributes the same) at the powers of two up to
+// the size of the job and at that size itself.
+
+CALIBRATION(calibrate_barrier,
+            mpi_test::scaling_weak,
+            mpi_test::placement_default,
+            0.,
+            mpi_test::world_sizes)
+{
+  MPI_Barrier(comm);
+}
+
+CALIBRATION(calibrate_allreduce_8,
+            mpi_test::scaling_weak,
+            mpi_test::placement_default,
+            8.,
+            mpi_test::world_sizes)
+{
+  allreduce(comm, 1);
+}
+
+CALIBRATION(calibrate_allreduce_64k,
+            mpi_test::scaling_weak,
+            mpi_test::placement_default,
+            1 << 16,
+            mpi_test::world_sizes)
+{
+  allreduce(comm, (1 << 16) / sizeof(double));
+}
+
+// 1 KiB to every other proc
+CALIBRATION(calibrate_alltoall_1k,
+            mpi_test::scaling_weak,
+            mpi_test::placement_default,
+            0.,
+            mpi_test::world_sizes)
+{
+  int size;
+  MPI_Comm_size(comm, &size);
+  const int bytes = 1 << 10;
+  MPI_Alltoall(scratch(0, size * bytes).data(),
+               bytes,
+               MPI_CHAR,
+               scratch(1, size * bytes).data(),
+               bytes,
+               MPI_CHAR,
+               comm);
+}
@@ -1,30 +1,3729 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <random>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "mpitest.h"
 
-#define FAIL_MESSAGE_SIZE 1024
+namespace mpi_test
+{
+  test_list* test_list::instance()
+  {
+    static test_list list;
+    return &list;
+  }
+
+  void link_test(test_info* info)
+  {
+    test_list* list = test_list::instance();
+
+    info->next = nullptr;
+    if (list->last)
+      list->last->next = info;
+    else
+      list->first = info;
+    list->last = info;
+    ++list->num_registered;
+  }
+
+  test_info test_proto(test_ptr test,
+                       const char* name,
+                       scaling_mode scaling,
+                       double timeout,
+                       placement_mode placement)
+  {
+    test_info proto = {};
+    proto.fptr      = test;
+    proto.test_name = name;
+    proto.scaling   = scaling;
+    proto.timeout   = timeout;
+    proto.placement = placement;
+    return proto;
+  }
+
+  test_info benchmark_proto(test_ptr test,
+                            const char* name,
+                            int warmup,
+                            int iterations,
+                            scaling_mode scaling,
+                            placement_mode placement)
+  {
+    test_info proto  = {};
+    proto.fptr       = test;
+    proto.test_name  = name;
+    proto.benchmark  = true;
+    proto.warmup     = warmup;
+    proto.iterations = iterations;
+    proto.scaling    = scaling;
+    proto.timeout    = -1.;
+    proto.placement  = placement;
+    return proto;
+  }
+
+  test_info fixture_proto(test_ptr test,
+                          const char* name,
+                          const fixture_info* fixture)
+  {
+    test_info proto = test_proto(test, name);
+    proto.fixture   = fixture;
+    return proto;
+  }
+
+  test_info benchmark_fixture_proto(test_ptr test,
+                                    const char* name,
+                                    const fixture_info* fixture)
+  {
+    test_info proto = benchmark_proto(test, name, -1, -1);
+    proto.fixture   = fixture;
+    return proto;
+  }
+
+  test_info thread_proto(test_ptr test, const char* name, int threads)
+  {
+    test_info proto = test_proto(test, name);
+    proto.threads   = threads;
+    return proto;
+  }
+
+  // Warmup and timed runs of every calibration body, they're all just a
+  // single (and mostly quick) operation.
+  static const int calibration_warmup     = 10;
+  static const int calibration_iterations = 100;
+
+  test_info calibration_proto(test_ptr test,
+                              const char* name,
+                              scaling_mode scaling,
+                              placement_mode placement,
+                              double bytes)
+  {
+    test_info proto = benchmark_proto(
+    test, name, calibration_warmup, calibration_iterations, scaling, placement);
+
+    proto.calibration       = true;
+    proto.calibration_bytes = bytes;
+    return proto;
+  }
+
+  // The copies of tests registered at "world_sizes", one for each size it
+  // stands for. A deque so they never move once they're indexed.
+  static std::deque<test_info> world_size_tests;
+
+  // Builds the "tests" index over the linked list of registered tests, this
+  // is where "world_sizes" gets replaced by the sizes it stands for now that
+  // the size of MPI_COMM_WORLD is known.
+  static void index_tests(test_list* list)
+  {
+    int world_size;
+    MPI_Comm_size(MPI_COMM_WORLD, &world_size);
+
+    std::vector<int> sizes;
+    for (int size = 2; size < world_size; size *= 2)
+      sizes.push_back(size);
+    if (world_size > 1)
+      sizes.push_back(world_size);
+
+    list->tests.reserve(list->num_registered);
+    for (test_info* t = list->first; t; t = t->next)
+    {
+      if (t->test_size != world_sizes)
+      {
+        list->tests.push_back(t);
+        continue;
+      }
+
+      for (int si = 0; si < sizes.size(); ++si)
+      {
+        world_size_tests.push_back(*t);
+        world_size_tests.back().test_size = sizes[si];
+        list->tests.push_back(&world_size_tests.back());
+      }
+    }
+  }
+
+  /* allocation tracking */
+
+  // The counters the allocation layer bumps. They're relaxed atomics, all
+  // anybody ever does with them is read them before and after something.
+  // They're constant initialized, so whatever gets allocated before the layer
+  // has announced itself is still counted.
+  static bool alloc_tracked = false;
+  static std::atomic<unsigned long long> num_allocations(0);
+  static std::atomic<unsigned long long> num_alloc_bytes(0);
+  static std::atomic<unsigned long long> live_bytes(0);
+  static std::atomic<unsigned long long> peak_bytes(0);
+
+  // Set while the runner itself allocates on this thread (around a test body,
+  // or to record a failure), none of that gets charged to the test. A block
+  // allocated like that isn't counted when it's freed either, whenever and
+  // wherever that happens (the allocation layer remembers).
+  static thread_local bool runner_allocating = false;
+
+  struct runner_allocations
+  {
+    bool saved;
+
+    runner_allocations() : saved(runner_allocating)
+    {
+      runner_allocating = true;
+    }
+
+    ~runner_allocations()
+    {
+      runner_allocating = saved;
+    }
+  };
+
+  // Runs the body of "t" with its allocations counted, inside of a
+  // "runner_allocations".
+  static void run_body(test_info& t, MPI_Comm comm)
+  {
+    runner_allocating = false;
+    t.fptr(comm);
+    runner_allocating = true;
+  }
+
+  void link_alloc_tracking()
+  {
+    alloc_tracked = true;
+  }
+
+  bool count_allocation(size_t size)
+  {
+    if (runner_allocating)
+      return false;
+
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    num_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    unsigned long long live =
+    live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+    unsigned long long peak = peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak &&
+           !peak_bytes.compare_exchange_weak(
+           peak, live, std::memory_order_relaxed))
+    {
+    }
+    return true;
+  }
+
+  void count_free(size_t size)
+  {
+    live_bytes.fetch_sub(size, std::memory_order_relaxed);
+  }
+
+  alloc_stats current_alloc_stats()
+  {
+    alloc_stats stats;
+    stats.num_allocations = num_allocations.load(std::memory_order_relaxed);
+    stats.num_bytes       = num_alloc_bytes.load(std::memory_order_relaxed);
+    stats.live_bytes      = live_bytes.load(std::memory_order_relaxed);
+    stats.peak_bytes      = peak_bytes.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  void reset_peak_bytes()
+  {
+    peak_bytes.store(live_bytes.load(std::memory_order_relaxed),
+                     std::memory_order_relaxed);
+  }
+
+  bool assert_max_allocations(unsigned long long start,
+                              unsigned long long max_allocations,
+                              const assert_info assertion)
+  {
+    if (!alloc_tracked)
+    {
+      runner_allocations paused;
+      register_error(assertion,
+                     "allocations aren't being counted, link with "
+                     "-lmpitest_alloc after -lmpitest");
+      return false;
+    }
+
+    unsigned long long allocations =
+    current_alloc_stats().num_allocations - start;
+    if (allocations <= max_allocations)
+      return true;
+
+    runner_allocations paused;
+    register_error(assertion,
+                   std::to_string(allocations) + " allocations, at most " +
+                   std::to_string(max_allocations) + " allowed");
+    return false;
+  }
+
+  /* thread teams */
+
+  // Every thread of a team registers its errors in its own buffer so there's
+  // no need for a lock, outside of a team they go straight to the list.
+  static thread_local std::vector<fail_info>* thread_fails = nullptr;
+  static thread_local int this_team_thread                 = 0;
+  static int this_team_size                                = 1;
+  static int provided_thread_level                         = MPI_THREAD_SINGLE;
+
+  int team_thread()
+  {
+    return this_team_thread;
+  }
+
+  int team_size()
+  {
+    return this_team_size;
+  }
+
+  int thread_level()
+  {
+    return provided_thread_level;
+  }
+
+  void register_error(const assert_info assertion, std::string reason)
+  {
+    runner_allocations paused;
+
+    std::vector<fail_info>* fails =
+    thread_fails ? thread_fails : &test_list::instance()->fails;
+    fails->push_back({assertion, reason});
+  }
+
+  // Runs the body of "t" on "t.threads" threads, this one included, then
+  // merges everybody's failures into the list in thread order.
+  static void run_team(test_info& t, MPI_Comm comm)
+  {
+    std::vector<std::vector<fail_info>> team_fails(t.threads);
+    this_team_size = t.threads;
+
+    std::function<void(int)> member = [&](int thread)
+    {
+      this_team_thread = thread;
+      thread_fails     = &team_fails[thread];
+      run_body(t, comm);
+      thread_fails     = nullptr;
+      this_team_thread = 0;
+    };
+
+    std::vector<std::thread> team;
+    for (int thread = 1; thread < t.threads; ++thread)
+      team.push_back(std::thread(member, thread));
+    member(0);
+    for (int thread = 0; thread < team.size(); ++thread)
+      team[thread].join();
+
+    this_team_size                = 1;
+    std::vector<fail_info>& fails = test_list::instance()->fails;
+    for (int thread = 0; thread < t.threads; ++thread)
+    {
+      for (int fi = 0; fi < team_fails[thread].size(); ++fi)
+      {
+        const fail_info& f = team_fails[thread][fi];
+        fails.push_back(
+        {f.assertion, "on thread " + std::to_string(thread) + ": " + f.reason});
+      }
+    }
+  }
+
+  /* collective assertions */
+
+  // Returns the number of processors of "comm" where "statement" is true.
+  static int count_true(bool statement, MPI_Comm comm)
+  {
+    int num_true = statement ? 1 : 0;
+    PMPI_Allreduce(MPI_IN_PLACE, &num_true, 1, MPI_INT, MPI_SUM, comm);
+    return num_true;
+  }
+
+  bool assert_all(bool statement, MPI_Comm comm, const assert_info assertion)
+  {
+    int size;
+    MPI_Comm_size(comm, &size);
+
+    int num_true = count_true(statement, comm);
+    if (num_true == size)
+      return true;
+
+    if (!statement)
+    {
+      runner_allocations paused;
+      register_error(assertion,
+                     "false on " + std::to_string(size - num_true) + " of " +
+                     std::to_string(size) + " procs (including this one)");
+    }
+    return false;
+  }
+
+  bool assert_any(bool statement, MPI_Comm comm, const assert_info assertion)
+  {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    if (count_true(statement, comm) > 0)
+      return true;
+
+    if (rank == 0)
+    {
+      runner_allocations paused;
+      register_error(assertion,
+                     "false on all " + std::to_string(size) + " procs");
+    }
+    return false;
+  }
+
+  /* distributed assertion support */
+
+  static void dist_verdict_combine(void* in,
+                                   void* inout,
+                                   int* len,
+                                   MPI_Datatype* /* type */)
+  {
+    dist_verdict* a = static_cast<dist_verdict*>(in);
+    dist_verdict* b = static_cast<dist_verdict*>(inout);
+    for (int i = 0; i < *len; ++i)
+    {
+      // Same as within a processor, a worst element that failed beats any
+      // that passed.
+      bool a_failed = a[i].num_mismatches > 0;
+      bool b_failed = b[i].num_mismatches > 0;
+      b[i].num_elements += a[i].num_elements;
+      b[i].num_mismatches += a[i].num_mismatches;
+      bool a_worse = (a_failed != b_failed)
+                     ? a_failed
+                     : (a[i].worst_ulp > b[i].worst_ulp ||
+                        (a[i].worst_ulp == b[i].worst_ulp &&
+                         a[i].worst_index < b[i].worst_index));
+      if (a_worse)
+      {
+        b[i].worst_ulp   = a[i].worst_ulp;
+        b[i].worst_index = a[i].worst_index;
+      }
+    }
+  }
+
+  // The datatype and operation are only built the first time a distributed
+  // assertion runs and then kept around, "free_dist_verdict_op" gets rid of
+  // them before MPI_Finalize().
+  static MPI_Datatype dist_verdict_type = MPI_DATATYPE_NULL;
+  static MPI_Op dist_verdict_op         = MPI_OP_NULL;
+
+  void reduce_dist_verdict(dist_verdict& verdict, MPI_Comm comm)
+  {
+    if (dist_verdict_op == MPI_OP_NULL)
+    {
+      MPI_Type_contiguous(4, MPI_UNSIGNED_LONG_LONG, &dist_verdict_type);
+      MPI_Type_commit(&dist_verdict_type);
+      MPI_Op_create(&dist_verdict_combine, 1, &dist_verdict_op);
+    }
+
+    PMPI_Allreduce(
+    MPI_IN_PLACE, &verdict, 1, dist_verdict_type, dist_verdict_op, comm);
+  }
+
+  static void free_dist_verdict_op()
+  {
+    if (dist_verdict_op == MPI_OP_NULL)
+      return;
+    MPI_Op_free(&dist_verdict_op);
+    MPI_Type_free(&dist_verdict_type);
+  }
+
+  void fail_dist_array(const assert_info assertion,
+                       const dist_verdict& verdict,
+                       int comm_size,
+                       int ulp_tol)
+  {
+    runner_allocations paused;
+
+    std::string reason =
+    std::to_string(verdict.num_mismatches) + " of " +
+    std::to_string(verdict.num_elements) + " elements differ across " +
+    std::to_string(comm_size) + " procs, the worst is element " +
+    std::to_string(verdict.worst_index) + " at ";
+
+    if (verdict.worst_ulp == std::numeric_limits<unsigned long long>::max())
+      reason += "nan or inf";
+    else
+      reason += std::to_string(verdict.worst_ulp) + " ULPs";
+
+    reason += " (the requested tolerance is " + std::to_string(ulp_tol) +
+              " ULPs)";
+    register_error(assertion, reason);
+  }
+
+  /* communication profiling */
+
+  // The counters the PMPI layer bumps, it only counts while "comm_counting"
+  // is set (which the runner does around the test body).
+  static bool comm_profiled = false;
+  static std::atomic<bool> comm_counting(false);
+  static std::atomic<unsigned long long> num_messages(0);
+  static std::atomic<unsigned long long> num_message_bytes(0);
+  static std::atomic<unsigned long long> num_collectives(0);
+
+  void link_comm_profiling()
+  {
+    comm_profiled = true;
+  }
+
+  void count_message(int count, MPI_Datatype type)
+  {
+    if (!comm_counting.load(std::memory_order_relaxed))
+      return;
+
+    int type_size;
+    PMPI_Type_size(type, &type_size);
+    num_messages.fetch_add(1, std::memory_order_relaxed);
+    num_message_bytes.fetch_add((unsigned long long)count * type_size,
+                                std::memory_order_relaxed);
+  }
+
+  void count_collective()
+  {
+    if (comm_counting.load(std::memory_order_relaxed))
+      num_collectives.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  comm_stats current_comm_stats()
+  {
+    comm_stats stats;
+    stats.num_messages    = num_messages.load(std::memory_order_relaxed);
+    stats.num_bytes       = num_message_bytes.load(std::memory_order_relaxed);
+    stats.num_collectives = num_collectives.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  static bool assert_max_sent(unsigned long long sent,
+                              unsigned long long max_sent,
+                              const char* what,
+                              const assert_info assertion)
+  {
+    if (!comm_profiled)
+    {
+      runner_allocations paused;
+      register_error(assertion,
+                     "communication isn't being counted, link with "
+                     "-lmpitest_pmpi after -lmpitest");
+      return false;
+    }
+
+    if (sent <= max_sent)
+      return true;
+
+    runner_allocations paused;
+    register_error(assertion,
+                   std::to_string(sent) + " " + what + " sent, at most " +
+                   std::to_string(max_sent) + " allowed");
+    return false;
+  }
+
+  bool assert_max_messages(unsigned long long start,
+                           unsigned long long max_messages,
+                           const assert_info assertion)
+  {
+    return assert_max_sent(current_comm_stats().num_messages - start,
+                           max_messages,
+                           "messages",
+                           assertion);
+  }
+
+  bool assert_max_bytes(unsigned long long start,
+                        unsigned long long max_bytes,
+                        const assert_info assertion)
+  {
+    return assert_max_sent(
+    current_comm_stats().num_bytes - start, max_bytes, "bytes", assertion);
+  }
+
+  /* failure formatting */
+
+  // This is where all of the failure messages of the assertions in the header
+  // actually get written.
+
+  template struct value_writer_of<bool>;
+  template struct value_writer_of<char>;
+  template struct value_writer_of<int>;
+  template struct value_writer_of<unsigned int>;
+  template struct value_writer_of<long>;
+  template struct value_writer_of<unsigned long>;
+  template struct value_writer_of<long long>;
+  template struct value_writer_of<unsigned long long>;
+  template struct value_writer_of<float>;
+  template struct value_writer_of<double>;
+
+  void write_pointer(std::ostream& out, const void* value)
+  {
+    out << value;
+  }
+
+  void fail_true_value(const assert_info assertion,
+                       const void* statement,
+                       value_writer write)
+  {
+    runner_allocations paused;
+
+    std::stringstream reason;
+    write(reason, statement);
+    reason << " is falsy";
+    register_error(assertion, reason.str());
+  }
+
+  void fail_eq_values(const assert_info assertion,
+                      const void* a,
+                      const void* b,
+                      value_writer write)
+  {
+    runner_allocations paused;
+
+    std::stringstream reason;
+    write(reason, a);
+    reason << " does not equal ";
+    write(reason, b);
+    register_error(assertion, reason.str());
+  }
+
+  void fail_array_values(const assert_info assertion,
+                         const void* a,
+                         const void* b,
+                         size_t element_size,
+                         size_t n,
+                         size_t num_mismatches,
+                         const size_t* listed,
+                         int num_listed,
+                         value_writer write)
+  {
+    runner_allocations paused;
+
+    std::stringstream reason;
+    reason << num_mismatches << " of " << n << " elements differ";
+
+    for (int li = 0; li < num_listed; ++li)
+    {
+      size_t offset = listed[li] * element_size;
+      reason << "\n    [" << listed[li] << "] ";
+      write(reason, static_cast<const char*>(a) + offset);
+      reason << " does not equal ";
+      write(reason, static_cast<const char*>(b) + offset);
+    }
+
+    register_error(assertion, reason.str());
+  }
+
+  // Writes why "a" and "b" didn't compare equal under the rules of
+  // "assert_ieee754_eq" (which this assumes already failed).
+  template<typename fxx, typename uxx>
+  static void write_ieee754_reason(std::ostream& reason,
+                                   fxx a,
+                                   fxx b,
+                                   int ulp_tol,
+                                   fxx abs_tol)
+  {
+    const int precision = std::numeric_limits<fxx>::digits10 + 1;
+
+    if (!std::isfinite(a) || !std::isfinite(b))
+    {
+      if (std::isnan(a))
+        reason << "the first argument is nan! ";
+      else if (std::isinf(a))
+        reason << "the first argument is inf! ";
+
+      if (std::isnan(b))
+        reason << "the second argument is nan! ";
+      else if (std::isinf(b))
+        reason << "the second argument is inf! ";
+    }
+    else if ((std::signbit(a) != std::signbit(b)) ||
+             (fabs(a) < abs_tol && fabs(b) < abs_tol))
+    {
+      reason << "absolute difference between " << std::setprecision(precision)
+             << a << " and " << b << " (" << fabs(a - b) << ")"
+             << " is outside the requested tolerance " << abs_tol;
+    }
+    else
+    {
+      uxx au, bu;
+      memcpy(&au, &a, sizeof(fxx));
+      memcpy(&bu, &b, sizeof(fxx));
+      reason << std::setprecision(precision) << a << " and " << b
+             << " differ by " << ((au > bu) ? au - bu : bu - au)
+             << " ULPs, the requested tolerance is " << ulp_tol << " ULPs";
+    }
+  }
+
+  template<typename fxx, typename uxx>
+  void fail_ieee754(const assert_info assertion,
+                    fxx a,
+                    fxx b,
+                    int ulp_tol,
+                    fxx abs_tol)
+  {
+    runner_allocations paused;
+
+    std::stringstream reason;
+    write_ieee754_reason<fxx, uxx>(reason, a, b, ulp_tol, abs_tol);
+    register_error(assertion, reason.str());
+  }
+
+  template<typename fxx, typename uxx>
+  void fail_ieee754_array(const assert_info assertion,
+                          const fxx* a,
+                          const fxx* b,
+                          size_t n,
+                          size_t num_mismatches,
+                          int ulp_tol,
+                          fxx abs_tol)
+  {
+    runner_allocations paused;
+
+    std::stringstream reason;
+    reason << num_mismatches << " of " << n << " elements differ";
+
+    int num_listed = 0;
+    for (size_t i = 0; i < n && num_listed < max_listed_mismatches; ++i)
+    {
+      if (!ieee754_mismatch<fxx, uxx>(a[i], b[i], ulp_tol, abs_tol))
+        continue;
+      reason << "\n    [" << i << "] ";
+      write_ieee754_reason<fxx, uxx>(reason, a[i], b[i], ulp_tol, abs_tol);
+      ++num_listed;
+    }
+
+    register_error(assertion, reason.str());
+  }
+
+  template void fail_ieee754<float, uint32_t>(
+  const assert_info, float, float, int, float);
+  template void fail_ieee754<double, uint64_t>(
+  const assert_info, double, double, int, double);
+  template void fail_ieee754_array<float, uint32_t>(
+  const assert_info, const float*, const float*, size_t, size_t, int, float);
+  template void fail_ieee754_array<double, uint64_t>(const assert_info,
+                                                     const double*,
+                                                     const double*,
+                                                     size_t,
+                                                     size_t,
+                                                     int,
+                                                     double);
+
+  /* options */
+
+  // Everything that can be set from the command line. Every processor parses
+  // the same command line so they all end up with the same options (and the
+  // same selection of tests) without talking to each other.
+  struct run_options
+  {
+    // Only tests whose name matches one of these globs are run (all of them if
+    // there are none).
+    std::vector<std::string> filters;
+
+    // Only tests registered at one of these sizes are run (all of them if
+    // there are none).
+    std::vector<int> sizes;
+
+    // Number of untimed and timed runs of a benchmark body unless the
+    // benchmark asks for something else.
+    int warmup     = 1;
+    int iterations = 10;
+
+    // Number of tests listed in the summary of the slowest tests.
+    int num_slowest = 10;
+
+    // This job runs shard "shard" (counting from 0) of "num_shards".
+    int shard      = 0;
+    int num_shards = 1;
+
+    // Seconds a test may take before the run is aborted, zero for no limit.
+    // Tests can override this individually.
+    double timeout = 0.;
+
+    // Whether to capture what test bodies print and show it under the result
+    // line, "all" for every test or "failed" only for the failing ones.
+    std::string capture;
+
+    // How to place tests that don't ask for a placement themselves.
+    placement_mode placement = placement_packed;
+
+    // Whether to report the heap (with the allocation layer) and resident
+    // memory usage of every test.
+    bool memory = false;
+
+    // Where to write machine readable reports (in addition to the console
+    // output), empty for nowhere.
+    std::string junit_path;
+    std::string json_path;
+
+    // A file of benchmark medians from an earlier run to compare against
+    // (empty for none). Benchmarks whose median is more than
+    // "baseline_tolerance" percent slower fail, with "update_baseline" the
+    // file is rewritten with the medians of this run instead.
+    std::string baseline_path;
+    bool update_baseline      = false;
+    double baseline_tolerance = 10.;
+
+    // The thread support to ask MPI for, the run stops if it isn't provided.
+    int thread_level = MPI_THREAD_SINGLE;
+
+    // How many times to run the selected tests (all within this one MPI
+    // session), with "until_fail" at most that many (or without end if
+    // "repeat" wasn't given) but stopping after the first pass with a
+    // failure. With "shuffle" every pass runs the tests in a different order,
+    // derived from "shuffle_seed".
+    int repeat            = 1;
+    bool repeat_set       = false;
+    bool until_fail       = false;
+    bool shuffle          = false;
+    bool seed_set         = false;
+    unsigned shuffle_seed = 0;
+
+    // Whether to start with the calibration suite.
+    bool calibrate = false;
+
+    // A file remembering how every test did last time (empty for none), which
+    // lets the run put the tests that failed (or never ran) first, run only
+    // those, or start the longest tests first.
+    std::string cache_path;
+    bool failed_first  = false;
+    bool only_failed   = false;
+    bool longest_first = false;
+  };
+
+  static run_options options;
+
+  static const char* usage =
+  "options:\n"
+  "  --filter=<glob>[,<glob>...]  only run tests with a matching name\n"
+  "  --sizes=<n>[,<n>...]         only run tests at these proc counts\n"
+  "  --warmup=<n>                 default untimed runs per benchmark\n"
+  "  --iterations=<n>             default timed runs per benchmark\n"
+  "  --slowest=<n>                number of slowest tests to list\n"
+  "  --shard=<i>/<n>              only run shard i (from 0) of n\n"
+  "  --timeout=<seconds>          abort if a test takes longer than this\n"
+  "  --placement=packed|spread|both  default rank placement of tests\n"
+  "  --capture=all|failed         capture test output and print it by proc\n"
+  "  --memory                     report the memory usage of every test\n"
+  "  --junit=<path>               also write a JUnit XML report\n"
+  "  --json=<path>                also write a JSON lines report\n"
+  "  --baseline=<path>            compare benchmarks against this baseline\n"
+  "  --baseline-tolerance=<pct>   how much slower than baseline is a fail\n"
+  "  --update-baseline            rewrite the baseline with this run\n"
+  "  --thread-level=single|funneled|serialized|multiple\n"
+  "                               thread support to ask MPI for\n"
+  "  --repeat=<n>                 run the selected tests n times\n"
+  "  --until-fail                 repeat until a pass has a failure\n"
+  "  --shuffle[=<seed>]           run the tests in a random order\n"
+  "  --calibrate                  start with the MPI calibration suite\n"
+  "  --cache=<path>               remember results in this file\n"
+  "  --failed-first               run cached failures and new tests first\n"
+  "  --only-failed                only run cached failures and new tests\n"
+  "  --longest-first              start the (cached) longest tests first\n"
+  "  --help                       print this and exit\n";
+
+  // Matches "str" against the glob "pattern" where "*" matches any run of
+  // characters and "?" any single character.
+  static bool glob_match(const char* pattern, const char* str)
+  {
+    const char* star       = nullptr;
+    const char* star_match = nullptr;
+    while (*str)
+    {
+      if (*pattern == '?' || *pattern == *str)
+      {
+        ++pattern;
+        ++str;
+      }
+      else if (*pattern == '*')
+      {
+        star       = pattern++;
+        star_match = str;
+      }
+      else if (star)
+      {
+        pattern = star + 1;
+        str     = ++star_match;
+      }
+      else
+      {
+        return false;
+      }
+    }
+    while (*pattern == '*')
+      ++pattern;
+    return *pattern == '\0';
+  }
+
+  static std::vector<std::string> split(const std::string& str, char delim)
+  {
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start <= str.size())
+    {
+      size_t end = str.find(delim, start);
+      if (end == std::string::npos)
+        end = str.size();
+      if (end > start)
+        parts.push_back(str.substr(start, end - start));
+      start = end + 1;
+    }
+    return parts;
+  }
+
+  // Parses a non-negative integer, returns false if "str" isn't one.
+  static bool parse_int(const std::string& str, int& value)
+  {
+    if (str.empty() || str.find_first_not_of("0123456789") != std::string::npos)
+      return false;
+    value = atoi(str.c_str());
+    return true;
+  }
+
+  struct thread_level_name
+  {
+    const char* name;
+    int level;
+  };
+
+  static const thread_level_name thread_level_names[] = {
+  {"single", MPI_THREAD_SINGLE},
+  {"funneled", MPI_THREAD_FUNNELED},
+  {"serialized", MPI_THREAD_SERIALIZED},
+  {"multiple", MPI_THREAD_MULTIPLE}};
+
+  static bool parse_thread_level(const std::string& str, int& level)
+  {
+    for (int li = 0; li < 4; ++li)
+    {
+      if (str == thread_level_names[li].name)
+      {
+        level = thread_level_names[li].level;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static const char* thread_level_str(int level)
+  {
+    for (int li = 0; li < 4; ++li)
+    {
+      if (level == thread_level_names[li].level)
+        return thread_level_names[li].name;
+    }
+    return "unknown";
+  }
+
+  // The thread level has to be known before MPI is initialized, which is
+  // before the rest of the command line gets parsed. Anything wrong with it
+  // gets reported by "parse_options" later.
+  static int requested_thread_level(int argc, char** argv)
+  {
+    int level = MPI_THREAD_SINGLE;
+    for (int ai = 1; ai < argc; ++ai)
+    {
+      std::string arg = argv[ai];
+      if (arg.compare(0, 15, "--thread-level=") == 0)
+        parse_thread_level(arg.substr(15), level);
+    }
+    return level;
+  }
+
+  // Fills in "options" from the command line. On a bad command line this
+  // returns false with an explanation in "error".
+  static bool parse_options(int argc, char** argv, std::string& error)
+  {
+    for (int ai = 1; ai < argc; ++ai)
+    {
+      std::string arg = argv[ai];
+      size_t eq       = arg.find('=');
+      std::string key = arg.substr(0, eq);
+      std::string val = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+
+      bool ok = true;
+      if (key == "--filter")
+      {
+        options.filters = split(val, ',');
+      }
+      else if (key == "--sizes")
+      {
+        std::vector<std::string> sizes = split(val, ',');
+        options.sizes.resize(sizes.size());
+        for (int si = 0; si < sizes.size(); ++si)
+          ok = ok && parse_int(sizes[si], options.sizes[si]);
+      }
+      else if (key == "--warmup")
+      {
+        ok = parse_int(val, options.warmup);
+      }
+      else if (key == "--iterations")
+      {
+        ok = parse_int(val, options.iterations) && options.iterations > 0;
+      }
+      else if (key == "--slowest")
+      {
+        ok = parse_int(val, options.num_slowest);
+      }
+      else if (key == "--shard")
+      {
+        std::vector<std::string> parts = split(val, '/');
+        ok = parts.size() == 2 && parse_int(parts[0], options.shard) &&
+             parse_int(parts[1], options.num_shards) &&
+             options.shard < options.num_shards;
+      }
+      else if (key == "--timeout")
+      {
+        char* end;
+        options.timeout = strtod(val.c_str(), &end);
+        ok              = !val.empty() && *end == '\0' && options.timeout >= 0.;
+      }
+      else if (key == "--placement")
+      {
+        ok = true;
+        if (val == "packed")
+          options.placement = placement_packed;
+        else if (val == "spread")
+          options.placement = placement_spread;
+        else if (val == "both")
+          options.placement = placement_both;
+        else
+          ok = false;
+      }
+      else if (key == "--capture")
+      {
+        options.capture = val;
+        ok              = (val == "all" || val == "failed");
+      }
+      else if (key == "--memory")
+      {
+        options.memory = true;
+        ok             = (eq == std::string::npos);
+      }
+      else if (key == "--junit")
+      {
+        options.junit_path = val;
+        ok                 = !val.empty();
+      }
+      else if (key == "--json")
+      {
+        options.json_path = val;
+        ok                = !val.empty();
+      }
+      else if (key == "--baseline")
+      {
+        options.baseline_path = val;
+        ok                    = !val.empty();
+      }
+      else if (key == "--baseline-tolerance")
+      {
+        char* end;
+        options.baseline_tolerance = strtod(val.c_str(), &end);
+        ok = !val.empty() && *end == '\0' && options.baseline_tolerance >= 0.;
+      }
+      else if (key == "--update-baseline")
+      {
+        options.update_baseline = true;
+        ok                      = (eq == std::string::npos);
+      }
+      else if (key == "--thread-level")
+      {
+        ok = parse_thread_level(val, options.thread_level);
+      }
+      else if (key == "--repeat")
+      {
+        options.repeat_set = true;
+        ok = parse_int(val, options.repeat) && options.repeat > 0;
+      }
+      else if (key == "--until-fail")
+      {
+        options.until_fail = true;
+        ok                 = (eq == std::string::npos);
+      }
+      else if (key == "--shuffle")
+      {
+        int seed         = 0;
+        options.shuffle  = true;
+        options.seed_set = (eq != std::string::npos);
+        ok = !options.seed_set || parse_int(val, seed);
+        options.shuffle_seed = (unsigned)seed;
+      }
+      else if (key == "--calibrate")
+      {
+        options.calibrate = true;
+        ok                = (eq == std::string::npos);
+      }
+      else if (key == "--cache")
+      {
+        options.cache_path = val;
+        ok                 = !val.empty();
+      }
+      else if (key == "--failed-first")
+      {
+        options.failed_first = true;
+        ok                   = (eq == std::string::npos);
+      }
+      else if (key == "--only-failed")
+      {
+        options.only_failed = true;
+        ok                  = (eq == std::string::npos);
+      }
+      else if (key == "--longest-first")
+      {
+        options.longest_first = true;
+        ok                    = (eq == std::string::npos);
+      }
+      else if (key == "--help")
+      {
+        error = usage;
+        return false;
+      }
+      else
+      {
+        error = "unknown option " + arg + "\n" + usage;
+        return false;
+      }
+
+      if (!ok)
+      {
+        error = "bad value in " + arg + "\n" + usage;
+        return false;
+      }
+    }
+    if (options.update_baseline && options.baseline_path.empty())
+    {
+      error = std::string("--update-baseline needs a --baseline=<path>\n") +
+              usage;
+      return false;
+    }
+    if ((options.failed_first || options.only_failed ||
+         options.longest_first) &&
+        options.cache_path.empty())
+    {
+      error = std::string("the cached orderings need a --cache=<path>\n") +
+              usage;
+      return false;
+    }
+    return true;
+  }
+
+  /* result cache */
+
+  // What the last run that cached it learned about a test at one size, keyed
+  // by name and size. The file has a line per test and size,
+  //   <build> pass|fail <seconds> <size> <name>
+  // where "build" identifies the binary that produced it (see "build_id").
+  // Rank 0 reads the file and hands its contents to everyone so they all
+  // order and shard the tests the same way, and only rank 0 writes it.
+  struct cached_result
+  {
+    std::string build;
+    bool failed;
+    double time;
+  };
+
+  typedef std::map<std::pair<std::string, int>, cached_result> result_cache;
+
+  static result_cache the_cache;
+
+  // Changes whenever the test binary is rebuilt, that's good enough to tell
+  // whether a cached result came from the binary that's running now.
+  static std::string find_build_id()
+  {
+    struct stat info;
+    if (stat("/proc/self/exe", &info) != 0)
+      return "unknown";
+
+    char id[64];
+    snprintf(id,
+             sizeof(id),
+             "%llx-%llx-%llx",
+             (unsigned long long)info.st_ino,
+             (unsigned long long)info.st_size,
+             (unsigned long long)info.st_mtime);
+    return id;
+  }
+
+  // The build id of rank 0's binary, set by "load_cache". Everybody compares
+  // against this one so procs running node local copies of the binary (with
+  // their own inodes and mtimes) still agree on the test order.
+  static std::string the_build_id;
+
+  static void parse_cache(const std::string& text, result_cache& cache)
+  {
+    std::vector<std::string> lines = split(text, '\n');
+    for (int li = 0; li < lines.size(); ++li)
+    {
+      char build[64], status[8];
+      double time;
+      int test_size, name_start = 0;
+      if (sscanf(lines[li].c_str(),
+                 "%63s %7s %lf %d %n",
+                 build,
+                 status,
+                 &time,
+                 &test_size,
+                 &name_start) != 4 ||
+          name_start == 0)
+        continue;
+
+      cached_result& cached =
+      cache[std::make_pair(lines[li].substr(name_start), test_size)];
+      cached.build  = build;
+      cached.failed = (strcmp(status, "fail") == 0);
+      cached.time   = time;
+    }
+  }
+
+  // Reads the cache on rank 0 and broadcasts it along with rank 0's build id
+  // (as the first line), collective over MPI_COMM_WORLD. A missing file is
+  // just an empty cache.
+  static void load_cache(const std::string& path, result_cache& cache)
+  {
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+    std::string text = (rank == 0) ? find_build_id() + "\n" : "";
+    FILE* file = (rank == 0) ? fopen(path.c_str(), "r") : nullptr;
+    if (file)
+    {
+      char buff[4096];
+      size_t length;
+      while ((length = fread(buff, 1, sizeof(buff), file)) > 0)
+        text.append(buff, length);
+      fclose(file);
+    }
+
+    int length = (int)text.size();
+    MPI_Bcast(&length, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    text.resize(length);
+    MPI_Bcast(&text[0], length, MPI_CHAR, 0, MPI_COMM_WORLD);
+
+    size_t id_end = text.find('\n');
+    the_build_id  = text.substr(0, id_end);
+    parse_cache(text.substr(id_end + 1), cache);
+  }
+
+  static const cached_result* find_cached(const test_info& t)
+  {
+    result_cache::const_iterator it =
+    the_cache.find(std::make_pair(std::string(t.test_name), t.test_size));
+    return (it == the_cache.end()) ? nullptr : &it->second;
+  }
+
+  // Tests that failed last time or that the cache doesn't know about yet.
+  static bool needs_rerun(const test_info& t)
+  {
+    const cached_result* cached = find_cached(t);
+    return !cached || cached->failed;
+  }
+
+  // How urgently --failed-first wants to run a test: the ones that need a
+  // rerun, then the ones that passed with some other build (they may well
+  // have changed since) and last the ones that passed with this very binary.
+  static int rerun_priority(const test_info& t)
+  {
+    if (needs_rerun(t))
+      return 2;
+    return (find_cached(t)->build != the_build_id) ? 1 : 0;
+  }
+
+  // Returns the indices of the tests selected by the name and size filters,
+  // in registration order.
+  static std::vector<int> select_tests(test_list* list)
+  {
+    std::vector<int> selected;
+    for (int ti = 0; ti < list->tests.size(); ++ti)
+    {
+      const test_info& t = *list->tests[ti];
+
+      bool name_ok = options.filters.empty();
+      for (int fi = 0; fi < options.filters.size() && !name_ok; ++fi)
+        name_ok = glob_match(options.filters[fi].c_str(), t.test_name);
+
+      bool size_ok = options.sizes.empty() ||
+                     std::find(options.sizes.begin(),
+                               options.sizes.end(),
+                               t.test_size) != options.sizes.end();
+
+      bool rerun_ok = !options.only_failed || needs_rerun(t);
+
+      if (name_ok && size_ok && rerun_ok && !t.calibration)
+        selected.push_back(ti);
+    }
+    return selected;
+  }
+
+  // The cost used to balance shards (and for --longest-first), the number of
+  // procs a test occupies times how long it took last time if that's cached.
+  // Every job has to see the same cache to agree on the shards. Tests the
+  // cache doesn't know count as if they took a second.
+  static double shard_cost(const test_info& t)
+  {
+    const cached_result* cached = find_cached(t);
+    return t.test_size * (cached ? cached->time : 1.);
+  }
+
+  // Keeps only the selected tests that belong to this job's shard. Tests are
+  // handed out largest cost first, each to the shard with the least total cost
+  // so far (ties to the lowest shard), which depends on nothing but the test
+  // list and the command line. The shards are the same in every job no matter
+  // how many procs it was launched with, so a suite can be fanned out across
+  // differently sized allocations.
+  static std::vector<int> shard_tests(test_list* list,
+                                      const std::vector<int>& selected)
+  {
+    if (options.num_shards == 1)
+      return selected;
+
+    std::vector<int> order(selected);
+    std::stable_sort(order.begin(), order.end(), [list](int a, int b) {
+      return shard_cost(*list->tests[a]) > shard_cost(*list->tests[b]);
+    });
+
+    std::vector<double> loads(options.num_shards, 0.);
+    std::vector<bool> mine(list->tests.size(), false);
+    for (int oi = 0; oi < order.size(); ++oi)
+    {
+      int lightest =
+      (int)(std::min_element(loads.begin(), loads.end()) - loads.begin());
+      loads[lightest] += shard_cost(*list->tests[order[oi]]);
+      mine[order[oi]] = (lightest == options.shard);
+    }
+
+    // back to registration order
+    std::vector<int> shard;
+    for (int si = 0; si < selected.size(); ++si)
+    {
+      if (mine[selected[si]])
+        shard.push_back(selected[si]);
+    }
+    return shard;
+  }
+
+  // Puts the selected tests in the order the command line asked for, that's
+  // also the order the scheduler fills the waves in. With --failed-first the
+  // cached failures and new tests go first (see "rerun_priority") and with
+  // --longest-first the costliest tests are started first (so they don't end
+  // up running alone at the end), both together sort by the first and then
+  // the second.
+  static void order_tests(test_list* list, std::vector<int>& selected)
+  {
+    if (!options.failed_first && !options.longest_first)
+      return;
+
+    std::stable_sort(selected.begin(), selected.end(), [list](int a, int b) {
+      const test_info& ta = *list->tests[a];
+      const test_info& tb = *list->tests[b];
+      if (options.failed_first && rerun_priority(ta) != rerun_priority(tb))
+        return rerun_priority(ta) > rerun_priority(tb);
+      return options.longest_first && shard_cost(ta) > shard_cost(tb);
+    });
+  }
+
+  /* topology */
+
+  // Which node every world rank is on, nodes are numbered from 0 in order of
+  // their lowest rank. This is the only thing the placements are based on.
+  struct topology
+  {
+    std::vector<int> node_of;
+    int num_nodes;
+  };
+
+  static topology find_topology()
+  {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // the lowest world rank on each node names it
+    MPI_Comm node_comm;
+    MPI_Comm_split_type(
+    MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node_comm);
+    int leader = rank;
+    MPI_Allreduce(MPI_IN_PLACE, &leader, 1, MPI_INT, MPI_MIN, node_comm);
+    MPI_Comm_free(&node_comm);
+
+    std::vector<int> leaders(size);
+    MPI_Allgather(
+    &leader, 1, MPI_INT, leaders.data(), 1, MPI_INT, MPI_COMM_WORLD);
+
+    topology topo;
+    topo.node_of.resize(size);
+    topo.num_nodes = 0;
+    for (int r = 0; r < size; ++r)
+      topo.node_of[r] =
+      (leaders[r] == r) ? topo.num_nodes++ : topo.node_of[leaders[r]];
+    return topo;
+  }
+
+  static const char* placement_name(placement_mode placement)
+  {
+    return (placement == placement_spread) ? "spread" : "packed";
+  }
+
+  // The name a test goes by wherever its packed and spread runs need to be
+  // told apart.
+  static std::string placed_name(const test_info& t, placement_mode placement)
+  {
+    if (placement == placement_spread)
+      return std::string(t.test_name) + " [spread]";
+    return t.test_name;
+  }
+
+  // A selected test together with the placement it's going to run with, a
+  // test that wants both placements shows up twice.
+  struct placed_test
+  {
+    int test;
+    placement_mode placement;
+  };
+
+  static std::vector<placed_test> place_tests(test_list* list,
+                                              const std::vector<int>& selected)
+  {
+    std::vector<placed_test> placed;
+    for (int si = 0; si < selected.size(); ++si)
+    {
+      placement_mode placement = list->tests[selected[si]]->placement;
+      if (placement == placement_default)
+        placement = options.placement;
+
+      if (placement == placement_both)
+      {
+        placed.push_back({selected[si], placement_packed});
+        placed.push_back({selected[si], placement_spread});
+      }
+      else
+      {
+        placed.push_back({selected[si], placement});
+      }
+    }
+    return placed;
+  }
+
+  // The fewest nodes "size" ranks fit on given how many free ranks each node
+  // has.
+  static int fewest_nodes(std::vector<int> free_per_node, int size)
+  {
+    std::sort(free_per_node.begin(), free_per_node.end(), std::greater<int>());
+    int num_nodes = 0;
+    for (int ni = 0; ni < free_per_node.size() && size > 0; ++ni, ++num_nodes)
+      size -= free_per_node[ni];
+    return num_nodes;
+  }
+
+  // Picks "size" of the "free" world ranks for a test with the given
+  // placement and marks them as used. A packed test goes on a single node if
+  // any has room and otherwise on the nodes with the most room first, a
+  // spread one takes a rank from every node in turn. Either way this gives up
+  // (and leaves "free" alone) if it can't do as well as it could on an idle
+  // machine, the test just has to wait for a later wave then.
+  static bool allocate_ranks(std::vector<bool>& free,
+                             int size,
+                             placement_mode placement,
+                             const topology& topo,
+                             std::vector<int>& ranks)
+  {
+    std::vector<std::vector<int>> by_node(topo.num_nodes);
+    std::vector<int> free_per_node(topo.num_nodes, 0);
+    std::vector<int> ranks_per_node(topo.num_nodes, 0);
+    int num_free = 0;
+    for (int r = 0; r < free.size(); ++r)
+    {
+      ++ranks_per_node[topo.node_of[r]];
+      if (!free[r])
+        continue;
+      by_node[topo.node_of[r]].push_back(r);
+      ++free_per_node[topo.node_of[r]];
+      ++num_free;
+    }
+    if (num_free < size)
+      return false;
+
+    ranks.clear();
+    if (placement == placement_spread)
+    {
+      int num_wanted = std::min(size, topo.num_nodes);
+      int num_usable = (int)(topo.num_nodes -
+                             std::count(free_per_node.begin(),
+                                        free_per_node.end(),
+                                        0));
+      if (num_usable < num_wanted)
+        return false;
+
+      for (int round = 0; ranks.size() < size; ++round)
+      {
+        for (int ni = 0; ni < topo.num_nodes && ranks.size() < size; ++ni)
+        {
+          if (round < by_node[ni].size())
+            ranks.push_back(by_node[ni][round]);
+        }
+      }
+    }
+    else
+    {
+      int num_needed = fewest_nodes(ranks_per_node, size);
+      if (fewest_nodes(free_per_node, size) > num_needed)
+        return false;
+
+      std::vector<int> order(topo.num_nodes);
+      for (int ni = 0; ni < topo.num_nodes; ++ni)
+        order[ni] = ni;
+      std::vector<int>::iterator fits =
+      std::find_if(order.begin(), order.end(), [&](int ni) {
+        return free_per_node[ni] >= size;
+      });
+      if (fits != order.end())
+        order.assign(1, *fits);
+      else
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+          return free_per_node[a] > free_per_node[b];
+        });
+
+      for (int oi = 0; oi < order.size() && ranks.size() < size; ++oi)
+      {
+        const std::vector<int>& node = by_node[order[oi]];
+        for (int ri = 0; ri < node.size() && ranks.size() < size; ++ri)
+          ranks.push_back(node[ri]);
+      }
+    }
+
+    for (int ri = 0; ri < ranks.size(); ++ri)
+      free[ranks[ri]] = false;
+    return true;
+  }
+
+  /* scheduling */
+
+  // A single test placed on the world ranks "ranks" (in the order they have
+  // in the test's communicator).
+  struct slot
+  {
+    int test;
+    placement_mode placement;
+    std::vector<int> ranks;
+  };
+
+  // A set of slots on disjoint ranks that all run at the same time.
+  typedef std::vector<slot> wave;
+
+  // Packs the placed tests into waves of concurrently running tests.
+  // Each wave is filled first-fit in registration order, so a test only waits
+  // on earlier tests if they didn't leave enough free ranks for it (or not on
+  // the right nodes). Every processor builds the same schedule from the same
+  // (statically built) test list and topology so no communication is needed
+  // to agree on who runs what. Benchmarks always get a wave to themselves so
+  // their timings aren't disturbed by whatever else would be running next to
+  // them.
+  static std::vector<wave> schedule(test_list* list,
+                                    const std::vector<placed_test>& placed,
+                                    const topology& topo)
+  {
+    std::vector<wave> waves;
+    std::vector<bool> done(placed.size(), false);
+    int num_remaining = (int)placed.size();
+
+    while (num_remaining > 0)
+    {
+      wave this_wave;
+      std::vector<bool> free(topo.node_of.size(), true);
+      for (int pi = 0; pi < placed.size(); ++pi)
+      {
+        const test_info& t = *list->tests[placed[pi].test];
+        if (done[pi] || (t.benchmark && !this_wave.empty()))
+          continue;
+
+        slot s = {placed[pi].test, placed[pi].placement, {}};
+        if (!allocate_ranks(free, t.test_size, s.placement, topo, s.ranks))
+          continue;
+
+        this_wave.push_back(s);
+        done[pi] = true;
+        --num_remaining;
+
+        if (t.benchmark)
+          break;
+      }
+      waves.push_back(this_wave);
+    }
+
+    return waves;
+  }
+
+  /* communicators */
+
+  // Caches one communicator per distinct slot shape (the world ranks in it).
+  // Building a shape's communicator only involves the ranks in it (through
+  // MPI_Comm_create_group) and only happens the first time the shape shows up,
+  // every test then gets a private MPI_Comm_dup of the cached communicator so
+  // tests still can't see each other's messages.
+  // The suite fixtures live here too, one per fixture type and shape. They're
+  // built on the cached communicator itself (the tests never see that one so
+  // it's safe to use) and the runner releases each one after its last use.
+  struct comm_cache
+  {
+    typedef std::pair<const fixture_info*, std::vector<int>> fixture_key;
+
+    std::map<std::vector<int>, MPI_Comm> comms;
+    std::map<fixture_key, void*> fixtures;
+
+    // Returns the cached communicator over the world ranks "ranks" (in that
+    // order), creating it if needed. This is collective over those ranks
+    // only.
+    MPI_Comm get(const std::vector<int>& ranks)
+    {
+      std::map<std::vector<int>, MPI_Comm>::iterator it = comms.find(ranks);
+      if (it != comms.end())
+        return it->second;
+
+      MPI_Group world_group, shape_group;
+      MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+      MPI_Group_incl(
+      world_group, (int)ranks.size(), ranks.data(), &shape_group);
+
+      MPI_Comm shape_comm;
+      MPI_Comm_create_group(MPI_COMM_WORLD, shape_group, 0, &shape_comm);
+
+      MPI_Group_free(&shape_group);
+      MPI_Group_free(&world_group);
+
+      comms[ranks] = shape_comm;
+      return shape_comm;
+    }
+
+    // Returns the fixture described by "info" for the shape "ranks", building
+    // it if needed. This is collective over those ranks.
+    void* fixture(const fixture_info* info, const std::vector<int>& ranks)
+    {
+      fixture_key key(info, ranks);
+      std::map<fixture_key, void*>::iterator it = fixtures.find(key);
+      if (it != fixtures.end())
+        return it->second;
+
+      void* instance = info->create(get(ranks));
+      fixtures[key]  = instance;
+      return instance;
+    }
+
+    void release_fixture(const fixture_info* info,
+                         const std::vector<int>& ranks)
+    {
+      std::map<fixture_key, void*>::iterator it =
+      fixtures.find(fixture_key(info, ranks));
+      if (it == fixtures.end())
+        return;
+
+      info->destroy(it->second);
+      fixtures.erase(it);
+    }
+
+    // Destroys any fixtures still around and frees every cached
+    // communicator, this must happen before MPI_Finalize().
+    void clear()
+    {
+      for (std::map<fixture_key, void*>::iterator it = fixtures.begin();
+           it != fixtures.end();
+           ++it)
+        it->first.first->destroy(it->second);
+      fixtures.clear();
+
+      for (std::map<std::vector<int>, MPI_Comm>::iterator it = comms.begin();
+           it != comms.end();
+           ++it)
+        MPI_Comm_free(&it->second);
+      comms.clear();
+    }
+  };
+
+  /* serialization */
+
+  // Failures (and later whole test results) are shipped around as one packed
+  // byte buffer per processor so the amount of data moved is exactly the
+  // amount of information there is. Each failure is the assertion line
+  // followed by the test string, file and reason, each of those as a length
+  // prefixed (not null terminated) string, so nothing ever gets truncated.
+  // The procs a failure happened on go as ranges of consecutive ranks.
+
+  // A failure as seen by the root that collected it, along with every proc it
+  // happened on (in increasing order).
+  struct rank_fail
+  {
+    std::vector<int> ranks;
+    int count;  // how many times it happened, over all of "ranks"
+    int line;
+    std::string test_string;
+    std::string file;
+    std::string reason;
+  };
+
+  static void pack_int(std::string& buff, int value)
+  {
+    buff.append(reinterpret_cast<const char*>(&value), sizeof(int));
+  }
+
+  static void pack_string(std::string& buff, const char* str, int length)
+  {
+    pack_int(buff, length);
+    buff.append(str, length);
+  }
+
+  static void pack_double(std::string& buff, double value)
+  {
+    buff.append(reinterpret_cast<const char*>(&value), sizeof(double));
+  }
+
+  static int unpack_int(const char*& cursor)
+  {
+    int value;
+    memcpy(&value, cursor, sizeof(int));
+    cursor += sizeof(int);
+    return value;
+  }
+
+  static double unpack_double(const char*& cursor)
+  {
+    double value;
+    memcpy(&value, cursor, sizeof(double));
+    cursor += sizeof(double);
+    return value;
+  }
+
+  static std::string unpack_string(const char*& cursor)
+  {
+    int length = unpack_int(cursor);
+    std::string str(cursor, length);
+    cursor += length;
+    return str;
+  }
+
+  static void pack_ranks(std::string& buff, const std::vector<int>& ranks)
+  {
+    std::vector<int> ranges;
+    for (int ri = 0; ri < ranks.size(); ++ri)
+    {
+      if (ri == 0 || ranks[ri] != ranks[ri - 1] + 1)
+        ranges.push_back(ranks[ri]);
+      if (ri + 1 == ranks.size() || ranks[ri + 1] != ranks[ri] + 1)
+        ranges.push_back(ranks[ri]);
+    }
+
+    pack_int(buff, (int)ranges.size() / 2);
+    for (int ri = 0; ri < ranges.size(); ++ri)
+      pack_int(buff, ranges[ri]);
+  }
+
+  static std::vector<int> unpack_ranks(const char*& cursor)
+  {
+    std::vector<int> ranks;
+    int num_ranges = unpack_int(cursor);
+    for (int ri = 0; ri < num_ranges; ++ri)
+    {
+      int first = unpack_int(cursor);
+      int last  = unpack_int(cursor);
+      for (int rank = first; rank <= last; ++rank)
+        ranks.push_back(rank);
+    }
+    return ranks;
+  }
+
+  static void pack_fail(std::string& buff, const rank_fail& f)
+  {
+    pack_ranks(buff, f.ranks);
+    pack_int(buff, f.count);
+    pack_int(buff, f.line);
+    pack_string(buff, f.test_string.data(), (int)f.test_string.size());
+    pack_string(buff, f.file.data(), (int)f.file.size());
+    pack_string(buff, f.reason.data(), (int)f.reason.size());
+  }
+
+  static rank_fail unpack_fail(const char*& cursor)
+  {
+    rank_fail f;
+    f.ranks       = unpack_ranks(cursor);
+    f.count       = unpack_int(cursor);
+    f.line        = unpack_int(cursor);
+    f.test_string = unpack_string(cursor);
+    f.file        = unpack_string(cursor);
+    f.reason      = unpack_string(cursor);
+    return f;
+  }
+
+  // Collects failures while merging the identical ones (same assertion, same
+  // reason) into a single failure with all of their procs and the total
+  // number of times it happened. Failures are kept in the order they were
+  // first seen.
+  struct fail_merger
+  {
+    typedef std::tuple<int, std::string, std::string, std::string> fail_key;
+
+    std::vector<rank_fail> fails;
+    std::map<fail_key, int> index;
+
+    void add(const rank_fail& f)
+    {
+      fail_key key(f.line, f.file, f.test_string, f.reason);
+      std::map<fail_key, int>::iterator it = index.find(key);
+      if (it == index.end())
+      {
+        index[key] = (int)fails.size();
+        fails.push_back(f);
+        return;
+      }
+
+      // Everything merged in comes from higher ranks (see "reduce_fails")
+      // so appending keeps the ranks sorted, a proc failing the same way
+      // twice is only listed once (but counted twice).
+      fails[it->second].count += f.count;
+      std::vector<int>& ranks = fails[it->second].ranks;
+      for (int ri = 0; ri < f.ranks.size(); ++ri)
+      {
+        if (ranks.empty() || f.ranks[ri] > ranks.back())
+          ranks.push_back(f.ranks[ri]);
+      }
+    }
+  };
+
+  // Collects one variable length buffer from every processor of "comm" on its
+  // root, in rank order. This is one small gather of buffer sizes and one
+  // MPI_Gatherv of the buffers themselves, processors with nothing to say just
+  // contribute zero bytes. The result is empty everywhere but the root.
+  static std::vector<std::string> gather_buffers(const std::string& send_buff,
+                                                 MPI_Comm comm)
+  {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    int send_length = (int)send_buff.size();
+
+    std::vector<int> lengths, displs;
+    if (rank == 0)
+    {
+      lengths.resize(size);
+      displs.resize(size);
+    }
+
+    MPI_Gather(
+    &send_length, 1, MPI_INT, lengths.data(), 1, MPI_INT, 0, comm);
+
+    std::vector<char> recv_buff;
+    if (rank == 0)
+    {
+      int total_length = 0;
+      for (int ri = 0; ri < size; ++ri)
+      {
+        displs[ri] = total_length;
+        total_length += lengths[ri];
+      }
+      recv_buff.resize(total_length);
+    }
+
+    MPI_Gatherv(send_buff.data(),
+                send_length,
+                MPI_CHAR,
+                recv_buff.data(),
+                lengths.data(),
+                displs.data(),
+                MPI_CHAR,
+                0,
+                comm);
+
+    std::vector<std::string> buffs;
+    if (rank == 0)
+    {
+      for (int ri = 0; ri < size; ++ri)
+        buffs.push_back(
+        std::string(recv_buff.data() + displs[ri], lengths[ri]));
+    }
+    return buffs;
+  }
+
+  static const int fail_tag = 4242;
+
+  // Collects every processor's failures on the root of "comm" with a binomial
+  // tree reduction: each processor merges in what its children send up and
+  // passes the result on to its parent (which has a lower rank). A failure
+  // that happened the same way everywhere moves up the tree as a single
+  // failure with a range of ranks, so what the root receives and prints
+  // depends on the number of distinct failures, not on ranks times failures.
+  // The result is empty everywhere but the root.
+  static std::vector<rank_fail>
+  reduce_fails(const std::vector<fail_info>& fails, MPI_Comm comm)
+  {
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    fail_merger merged;
+    for (int fi = 0; fi < fails.size(); ++fi)
+    {
+      rank_fail f;
+      f.ranks.push_back(rank);
+      f.count       = 1;
+      f.line        = fails[fi].assertion.line;
+      f.test_string = fails[fi].assertion.test_string;
+      f.file        = fails[fi].assertion.file;
+      f.reason      = fails[fi].reason;
+      merged.add(f);
+    }
+
+    for (int mask = 1; mask < size; mask <<= 1)
+    {
+      if (rank & mask)
+      {
+        std::string buff;
+        for (int fi = 0; fi < merged.fails.size(); ++fi)
+          pack_fail(buff, merged.fails[fi]);
+        MPI_Send(buff.data(),
+                 (int)buff.size(),
+                 MPI_CHAR,
+                 rank - mask,
+                 fail_tag,
+                 comm);
+        return std::vector<rank_fail>();
+      }
+
+      if (rank + mask < size)
+      {
+        MPI_Status status;
+        int length;
+        MPI_Probe(rank + mask, fail_tag, comm, &status);
+        MPI_Get_count(&status, MPI_CHAR, &length);
+
+        std::vector<char> buff(length);
+        MPI_Recv(buff.data(),
+                 length,
+                 MPI_CHAR,
+                 rank + mask,
+                 fail_tag,
+                 comm,
+                 MPI_STATUS_IGNORE);
+
+        const char* cursor = buff.data();
+        while (cursor < buff.data() + length)
+          merged.add(unpack_fail(cursor));
+      }
+    }
+    return merged.fails;
+  }
+
+  // Formats a sorted list of ranks compactly, e.g. "0-3,7,9-10".
+  static std::string format_ranks(const std::vector<int>& ranks)
+  {
+    std::string str;
+    for (int ri = 0; ri < ranks.size();)
+    {
+      int rj = ri;
+      while (rj + 1 < ranks.size() && ranks[rj + 1] == ranks[rj] + 1)
+        ++rj;
+
+      if (!str.empty())
+        str += ",";
+      str += std::to_string(ranks[ri]);
+      if (rj > ri)
+        str += "-" + std::to_string(ranks[rj]);
+      ri = rj + 1;
+    }
+    return str;
+  }
+
+  // The procs a failure happened on, with how many times it happened when
+  // that's more than once, e.g. "procs 0-3 (x37)".
+  static std::string format_fail_ranks(const rank_fail& f)
+  {
+    std::string str = (f.ranks.size() > 1) ? "procs " : "proc ";
+    str += format_ranks(f.ranks);
+    if (f.count > 1)
+      str += " (x" + std::to_string(f.count) + ")";
+    return str;
+  }
+
+  /* results */
+
+  // Captured output from one processor of a test.
+  struct rank_output
+  {
+    int rank;
+    std::string text;
+  };
+
+  // What "--memory" reports for every test, measured per processor over the
+  // test body and then summed and maxed over the processors of the test.
+  // Everything is counted in bytes except the allocations. The peaks are how
+  // far the heap and the resident set grew beyond where they were when the
+  // body started at their highest (see "reset_peak_rss" for the caveat on
+  // the resident set), "live at exit" is what the body allocated and didn't
+  // free.
+  enum mem_stat
+  {
+    mem_allocations,
+    mem_allocated,
+    mem_peak_heap,
+    mem_peak_rss,
+    mem_live_at_exit,
+    num_mem_stats
+  };
+
+  static const char* mem_stat_names[num_mem_stats] = {"allocations",
+                                                      "allocated_bytes",
+                                                      "peak_heap_bytes",
+                                                      "peak_rss_bytes",
+                                                      "live_bytes_at_exit"};
+
+  // Only the resident set gets measured without the allocation layer.
+  static bool mem_stat_measured(int mi)
+  {
+    return alloc_tracked || mi == mem_peak_rss;
+  }
+
+  // A benchmark runs its body many times, so its allocations and allocated
+  // bytes are averaged over all of those runs (warmup included) and that goes
+  // into their names. Averages get a couple of decimals.
+  static bool mem_stat_per_run(int mi, const test_info& t)
+  {
+    return t.benchmark && (mi == mem_allocations || mi == mem_allocated);
+  }
+
+  static std::string mem_stat_name(int mi, const test_info& t)
+  {
+    return std::string(mem_stat_names[mi]) +
+           (mem_stat_per_run(mi, t) ? "_per_run" : "");
+  }
+
+  static int mem_stat_precision(int mi, const test_info& t)
+  {
+    return mem_stat_per_run(mi, t) ? 2 : 0;
+  }
+
+  // Same thing for the communication counted by the PMPI layer, which gets
+  // reported whenever it's linked in.
+  enum comm_stat
+  {
+    comm_messages,
+    comm_bytes,
+    comm_collectives,
+    num_comm_stats
+  };
+
+  static const char* comm_stat_names[num_comm_stats] = {
+  "messages", "message_bytes", "collectives"};
+
+  // Everything the runner learns about a single test, assembled on the root of
+  // the test communicator and then sent on to rank 0 of MPI_COMM_WORLD which
+  // does all of the printing.
+  struct test_result
+  {
+    int test;
+
+    // How the test was placed and on how many nodes it ended up.
+    int placement;
+    int num_nodes;
+
+    std::vector<rank_fail> fails;
+
+    // Benchmarks only, statistics across processors of the median time each
+    // processor took for one timed run of the body. The imbalance is the
+    // slowest processor over the mean.
+    double bench_min;
+    double bench_median;
+    double bench_max;
+    double bench_imbalance;
+
+    // Wall time of the test body and of the runner's own work around it.
+    double time;
+    double runner_time;
+
+    // Only with "--memory".
+    double mem_sum[num_mem_stats];
+    double mem_max[num_mem_stats];
+
+    // Only with the PMPI layer.
+    double comm_sum[num_comm_stats];
+    double comm_max[num_comm_stats];
+
+    // Benchmarks only, the baseline median this one was compared against (on
+    // rank 0 after collection, zero if there was none).
+    double baseline;
+
+    // Whatever the body printed (only when output is being captured), one
+    // entry per processor that printed anything.
+    std::vector<rank_output> output;
+  };
+
+  static void pack_result(std::string& buff, const test_result& result)
+  {
+    pack_int(buff, result.test);
+    pack_int(buff, result.placement);
+    pack_int(buff, result.num_nodes);
+    pack_int(buff, (int)result.fails.size());
+    for (int fi = 0; fi < result.fails.size(); ++fi)
+      pack_fail(buff, result.fails[fi]);
+    pack_double(buff, result.bench_min);
+    pack_double(buff, result.bench_median);
+    pack_double(buff, result.bench_max);
+    pack_double(buff, result.bench_imbalance);
+    pack_double(buff, result.time);
+    pack_double(buff, result.runner_time);
+    for (int mi = 0; mi < num_mem_stats; ++mi)
+    {
+      pack_double(buff, result.mem_sum[mi]);
+      pack_double(buff, result.mem_max[mi]);
+    }
+    for (int ci = 0; ci < num_comm_stats; ++ci)
+    {
+      pack_double(buff, result.comm_sum[ci]);
+      pack_double(buff, result.comm_max[ci]);
+    }
+    pack_int(buff, (int)result.output.size());
+    for (int oi = 0; oi < result.output.size(); ++oi)
+    {
+      const rank_output& o = result.output[oi];
+      pack_int(buff, o.rank);
+      pack_string(buff, o.text.data(), (int)o.text.size());
+    }
+  }
+
+  static test_result unpack_result(const char*& cursor)
+  {
+    test_result result;
+    result.test      = unpack_int(cursor);
+    result.placement = unpack_int(cursor);
+    result.num_nodes = unpack_int(cursor);
+    int num_fails    = unpack_int(cursor);
+    for (int fi = 0; fi < num_fails; ++fi)
+      result.fails.push_back(unpack_fail(cursor));
+    result.bench_min       = unpack_double(cursor);
+    result.bench_median    = unpack_double(cursor);
+    result.bench_max       = unpack_double(cursor);
+    result.bench_imbalance = unpack_double(cursor);
+    result.time            = unpack_double(cursor);
+    result.runner_time     = unpack_double(cursor);
+    for (int mi = 0; mi < num_mem_stats; ++mi)
+    {
+      result.mem_sum[mi] = unpack_double(cursor);
+      result.mem_max[mi] = unpack_double(cursor);
+    }
+    for (int ci = 0; ci < num_comm_stats; ++ci)
+    {
+      result.comm_sum[ci] = unpack_double(cursor);
+      result.comm_max[ci] = unpack_double(cursor);
+    }
+    result.baseline = 0.;
+    int num_output  = unpack_int(cursor);
+    for (int oi = 0; oi < num_output; ++oi)
+    {
+      rank_output o;
+      o.rank = unpack_int(cursor);
+      o.text = unpack_string(cursor);
+      result.output.push_back(o);
+    }
+    return result;
+  }
+
+  // Prints a duration with a unit that keeps the number readable.
+  static std::string format_time(double seconds)
+  {
+    char buff[32];
+    if (seconds < 1e-3)
+      snprintf(buff, sizeof(buff), "%.2f us", seconds * 1e6);
+    else if (seconds < 1.)
+      snprintf(buff, sizeof(buff), "%.2f ms", seconds * 1e3);
+    else
+      snprintf(buff, sizeof(buff), "%.2f s", seconds);
+    return buff;
+  }
+
+  // Same idea as "format_time" but for a number of bytes.
+  static std::string format_bytes(double bytes)
+  {
+    char buff[32];
+    if (fabs(bytes) < 1024.)
+      snprintf(buff, sizeof(buff), "%.0f B", bytes);
+    else if (fabs(bytes) < 1024. * 1024.)
+      snprintf(buff, sizeof(buff), "%.2f KiB", bytes / 1024.);
+    else if (fabs(bytes) < 1024. * 1024. * 1024.)
+      snprintf(buff, sizeof(buff), "%.2f MiB", bytes / (1024. * 1024.));
+    else
+      snprintf(buff, sizeof(buff), "%.2f GiB", bytes / (1024. * 1024. * 1024.));
+    return buff;
+  }
+
+  static void print_result(const test_result& result, test_list* list)
+  {
+    const test_info& t = *list->tests[result.test];
+
+    for (int fi = 0; fi < result.fails.size(); ++fi)
+    {
+      const rank_fail& f = result.fails[fi];
+      if (f.line == 0)
+      {
+        // not from an assertion, the runner failed the test itself
+        printf("  %s FAILED (against %s)\n    %s\n",
+               f.test_string.c_str(),
+               f.file.c_str(),
+               f.reason.c_str());
+        continue;
+      }
+      printf("  %s FAILED (on %s line %d of %s)\n    %s\n",
+             f.test_string.c_str(),
+             format_fail_ranks(f).c_str(),
+             f.line,
+             f.file.c_str(),
+             f.reason.c_str());
+    }
+
+    if (t.benchmark)
+    {
+      printf("[ BENCH   ] %s median %s (min %s, max %s across procs, "
+             "imbalance %.2f)\n",
+             t.test_name,
+             format_time(result.bench_median).c_str(),
+             format_time(result.bench_min).c_str(),
+             format_time(result.bench_max).c_str(),
+             result.bench_imbalance);
+      if (result.baseline > 0.)
+        printf("[ BENCH   ] %s baseline %s (%+.1f%%)\n",
+               t.test_name,
+               format_time(result.baseline).c_str(),
+               100. * (result.bench_median / result.baseline - 1.));
+      if (t.calibration_bytes > 0. && result.bench_median > 0.)
+        printf("[ CALIB   ] %s %s per run, %s/s\n",
+               t.test_name,
+               format_bytes(t.calibration_bytes).c_str(),
+               format_bytes(t.calibration_bytes / result.bench_median).c_str());
+    }
+
+    if (options.memory && !alloc_tracked)
+    {
+      printf("[ MEMORY  ] %s peak rss %s (max %s)\n",
+             t.test_name,
+             format_bytes(result.mem_sum[mem_peak_rss]).c_str(),
+             format_bytes(result.mem_max[mem_peak_rss]).c_str());
+    }
+    else if (options.memory)
+    {
+      const char* per_run = t.benchmark ? " per run" : "";
+      int precision       = mem_stat_precision(mem_allocations, t);
+      printf("[ MEMORY  ] %s %.*f allocations%s (max %.*f), %s allocated%s "
+             "(max %s), peak heap %s (max %s), peak rss %s (max %s), %s live "
+             "at exit (max %s)\n",
+             t.test_name,
+             precision,
+             result.mem_sum[mem_allocations],
+             per_run,
+             precision,
+             result.mem_max[mem_allocations],
+             format_bytes(result.mem_sum[mem_allocated]).c_str(),
+             per_run,
+             format_bytes(result.mem_max[mem_allocated]).c_str(),
+             format_bytes(result.mem_sum[mem_peak_heap]).c_str(),
+             format_bytes(result.mem_max[mem_peak_heap]).c_str(),
+             format_bytes(result.mem_sum[mem_peak_rss]).c_str(),
+             format_bytes(result.mem_max[mem_peak_rss]).c_str(),
+             format_bytes(result.mem_sum[mem_live_at_exit]).c_str(),
+             format_bytes(result.mem_max[mem_live_at_exit]).c_str());
+    }
+
+    if (comm_profiled)
+    {
+      printf("[ COMM    ] %s %.0f messages (max %.0f), %s sent (max %s), %.0f "
+             "collectives (max %.0f)\n",
+             t.test_name,
+             result.comm_sum[comm_messages],
+             result.comm_max[comm_messages],
+             format_bytes(result.comm_sum[comm_bytes]).c_str(),
+             format_bytes(result.comm_max[comm_bytes]).c_str(),
+             result.comm_sum[comm_collectives],
+             result.comm_max[comm_collectives]);
+    }
+
+    printf("%s %s (%s, runner %s, %s on %d node%s)\n",
+           result.fails.empty() ? "[ SUCCESS ]" : "[ FAIL    ]",
+           t.test_name,
+           format_time(result.time).c_str(),
+           format_time(result.runner_time).c_str(),
+           placement_name((placement_mode)result.placement),
+           result.num_nodes,
+           (result.num_nodes > 1) ? "s" : "");
+
+    for (int oi = 0; oi < result.output.size(); ++oi)
+    {
+      const rank_output& o = result.output[oi];
+      printf("  --- output from proc %d ---\n%s", o.rank, o.text.c_str());
+      if (o.text.back() != '\n')
+        printf("\n");
+    }
+  }
+
+  // Lists the slowest of the given results, slowest first.
+  static void print_slowest(std::vector<test_result> results, test_list* list)
+  {
+    std::stable_sort(results.begin(),
+                     results.end(),
+                     [](const test_result& a, const test_result& b) {
+                       return a.time > b.time;
+                     });
+    if (results.size() > options.num_slowest)
+      results.resize(options.num_slowest);
+
+    if (results.empty())
+      return;
+
+    printf("\nslowest tests:\n");
+    for (int ri = 0; ri < results.size(); ++ri)
+    {
+      const test_info& t = *list->tests[results[ri].test];
+      const char* plural = (t.test_size > 1) ? "s" : "";
+      printf("  %10s  %s (%d proc%s)\n",
+             format_time(results[ri].time).c_str(),
+             placed_name(t, (placement_mode)results[ri].placement).c_str(),
+             t.test_size,
+             plural);
+    }
+  }
+
+  // How often every test (by placement) ran and failed over all the passes of
+  // a repeated run.
+  struct failure_rate
+  {
+    int runs;
+    int fails;
+  };
+
+  typedef std::map<std::pair<int, int>, failure_rate> failure_rates;
+
+  static void count_failures(const test_result& result, failure_rates& rates)
+  {
+    failure_rate& rate = rates[std::make_pair(result.test, result.placement)];
+    ++rate.runs;
+    if (!result.fails.empty())
+      ++rate.fails;
+  }
+
+  // Lists the tests that failed at least once, most failing first.
+  static void print_failure_rates(const failure_rates& rates,
+                                  int num_passes,
+                                  test_list* list)
+  {
+    std::vector<std::pair<std::pair<int, int>, failure_rate>> failing;
+    for (failure_rates::const_iterator it = rates.begin(); it != rates.end();
+         ++it)
+    {
+      if (it->second.fails > 0)
+        failing.push_back(*it);
+    }
+    std::stable_sort(failing.begin(),
+                     failing.end(),
+                     [](const std::pair<std::pair<int, int>, failure_rate>& a,
+                        const std::pair<std::pair<int, int>, failure_rate>& b) {
+                       return a.second.fails * b.second.runs >
+                              b.second.fails * a.second.runs;
+                     });
+
+    printf("\nfailure rates over %d pass%s:\n",
+           num_passes,
+           (num_passes > 1) ? "es" : "");
+    if (failing.empty())
+      printf("  no failures\n");
+    for (int fi = 0; fi < failing.size(); ++fi)
+    {
+      const test_info& t       = *list->tests[failing[fi].first.first];
+      const failure_rate& rate = failing[fi].second;
+      const char* plural       = (t.test_size > 1) ? "s" : "";
+      printf(
+      "  %5d / %-5d (%6.2f%%)  %s (%d proc%s)\n",
+      rate.fails,
+      rate.runs,
+      100. * rate.fails / rate.runs,
+      placed_name(t, (placement_mode)failing[fi].first.second).c_str(),
+      t.test_size,
+      plural);
+    }
+  }
+
+  // Prints a scaling summary for every test registered with a scaling mode.
+  // All the sizes of one test share its function pointer, so that's what the
+  // results are grouped by (along with the placement), and within a group
+  // everything is relative to the smallest size.
+  static void print_scaling(const std::vector<test_result>& results,
+                            test_list* list)
+  {
+    std::vector<bool> done(results.size(), false);
+    for (int ri = 0; ri < results.size(); ++ri)
+    {
+      const test_info& first = *list->tests[results[ri].test];
+      if (done[ri] || first.scaling == scaling_none)
+        continue;
+
+      std::vector<const test_result*> group;
+      for (int rj = ri; rj < results.size(); ++rj)
+      {
+        if (list->tests[results[rj].test]->fptr != first.fptr ||
+            results[rj].placement != results[ri].placement)
+          continue;
+        group.push_back(&results[rj]);
+        done[rj] = true;
+      }
+      std::stable_sort(group.begin(),
+                       group.end(),
+                       [list](const test_result* a, const test_result* b) {
+                         return list->tests[a->test]->test_size <
+                                list->tests[b->test]->test_size;
+                       });
+
+      bool strong = (first.scaling == scaling_strong);
+      printf(
+      "\n%s scaling of %s:\n",
+      strong ? "strong" : "weak",
+      placed_name(first, (placement_mode)results[ri].placement).c_str());
+      printf("  %8s  %10s  %8s  %10s\n",
+             "procs",
+             "time",
+             "speedup",
+             "efficiency");
+
+      double base_time = 0.;
+      int base_size    = 0;
+      for (int gi = 0; gi < group.size(); ++gi)
+      {
+        const test_info& t = *list->tests[group[gi]->test];
+        double time = t.benchmark ? group[gi]->bench_max : group[gi]->time;
+        if (gi == 0)
+        {
+          base_time = time;
+          base_size = t.test_size;
+        }
+
+        // Strong scaling should speed up with the proc count at fixed total
+        // work, weak scaling should hold its time while the work grows with
+        // the proc count.
+        double ratio      = (time > 0.) ? base_time / time : 0.;
+        double procs      = (double)t.test_size / base_size;
+        double speedup    = strong ? ratio : ratio * procs;
+        double efficiency = strong ? ratio / procs : ratio;
+
+        printf("  %8d  %10s  %8.2f  %9.1f%%\n",
+               t.test_size,
+               format_time(time).c_str(),
+               speedup,
+               100. * efficiency);
+      }
+    }
+  }
+
+  /* machine readable reports */
+
+  // Rank 0 writes these as it goes, one record per test as soon as the test's
+  // result arrives, so nothing beyond the current wave is ever held in memory
+  // for them and a run that gets killed still leaves everything up to that
+  // point on disk. JUnit XML is for CI systems that understand it, the JSON
+  // lines format (one object per test) is for everything else.
+  struct report_writer
+  {
+    FILE* junit = nullptr;
+    FILE* json  = nullptr;
+
+    void open();
+    void write(const test_result& result, test_list* list);
+    void write_skipped(const test_info& t);
+    void write_node(int node,
+                    const std::string& host,
+                    const std::vector<int>& ranks,
+                    double bandwidth,
+                    double latency,
+                    bool outlier);
+    void close();
+  };
+
+  static std::string xml_escape(const std::string& str)
+  {
+    std::string escaped;
+    for (int ci = 0; ci < str.size(); ++ci)
+    {
+      switch (str[ci])
+      {
+        case '&': escaped += "&amp;"; break;
+        case '<': escaped += "&lt;"; break;
+        case '>': escaped += "&gt;"; break;
+        case '"': escaped += "&quot;"; break;
+        case '\'': escaped += "&apos;"; break;
+        default: escaped += str[ci];
+      }
+    }
+    return escaped;
+  }
+
+  static std::string json_escape(const std::string& str)
+  {
+    std::string escaped;
+    for (int ci = 0; ci < str.size(); ++ci)
+    {
+      unsigned char c = str[ci];
+      if (c == '"' || c == '\\')
+      {
+        escaped += '\\';
+        escaped += c;
+      }
+      else if (c == '\n')
+      {
+        escaped += "\\n";
+      }
+      else if (c < 0x20)
+      {
+        char buff[8];
+        snprintf(buff, sizeof(buff), "\\u%04x", c);
+        escaped += buff;
+      }
+      else
+      {
+        escaped += c;
+      }
+    }
+    return escaped;
+  }
+
+  // The name a test goes by in the reports, the same test at different sizes
+  // (or placements) needs to come out as different test cases.
+  static std::string report_name(const test_info& t, int placement)
+  {
+    const char* plural = (t.test_size > 1) ? "s" : "";
+    return placed_name(t, (placement_mode)placement) + " (" +
+           std::to_string(t.test_size) + " proc" + plural + ")";
+  }
+
+  void report_writer::open()
+  {
+    if (!options.junit_path.empty())
+    {
+      junit = fopen(options.junit_path.c_str(), "w");
+      if (!junit)
+        printf("couldn't open %s for writing!\n", options.junit_path.c_str());
+      else
+        fprintf(junit,
+                "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<testsuites>\n"
+                "  <testsuite name=\"mpitest\">\n");
+    }
+
+    if (!options.json_path.empty())
+    {
+      json = fopen(options.json_path.c_str(), "w");
+      if (!json)
+        printf("couldn't open %s for writing!\n", options.json_path.c_str());
+    }
+  }
+
+  void report_writer::write(const test_result& result, test_list* list)
+  {
+    const test_info& t = *list->tests[result.test];
+
+    if (junit)
+    {
+      fprintf(junit,
+              "    <testcase name=\"%s\" classname=\"%s\" time=\"%.6f\">\n"
+              "      <properties>\n"
+              "        <property name=\"procs\" value=\"%d\"/>\n"
+              "        <property name=\"placement\" value=\"%s\"/>\n"
+              "        <property name=\"nodes\" value=\"%d\"/>\n"
+              "        <property name=\"runner_time\" value=\"%.6f\"/>\n",
+              xml_escape(report_name(t, result.placement)).c_str(),
+              xml_escape(t.test_name).c_str(),
+              result.time,
+              t.test_size,
+              placement_name((placement_mode)result.placement),
+              result.num_nodes,
+              result.runner_time);
+      if (t.benchmark)
+        fprintf(junit,
+                "        <property name=\"bench_min\" value=\"%.9f\"/>\n"
+                "        <property name=\"bench_median\" value=\"%.9f\"/>\n"
+                "        <property name=\"bench_max\" value=\"%.9f\"/>\n"
+                "        <property name=\"bench_imbalance\" value=\"%.4f\"/>\n",
+                result.bench_min,
+                result.bench_median,
+                result.bench_max,
+                result.bench_imbalance);
+      if (t.calibration_bytes > 0. && result.bench_median > 0.)
+        fprintf(junit,
+                "        <property name=\"bandwidth\" value=\"%.6e\"/>\n",
+                t.calibration_bytes / result.bench_median);
+      for (int mi = 0; options.memory && mi < num_mem_stats; ++mi)
+        if (mem_stat_measured(mi))
+          fprintf(junit,
+                  "        <property name=\"%s\" value=\"%.*f\"/>\n"
+                  "        <property name=\"max_%s\" value=\"%.*f\"/>\n",
+                  mem_stat_name(mi, t).c_str(),
+                  mem_stat_precision(mi, t),
+                  result.mem_sum[mi],
+                  mem_stat_name(mi, t).c_str(),
+                  mem_stat_precision(mi, t),
+                  result.mem_max[mi]);
+      for (int ci = 0; comm_profiled && ci < num_comm_stats; ++ci)
+        fprintf(junit,
+                "        <property name=\"%s\" value=\"%.0f\"/>\n"
+                "        <property name=\"max_%s\" value=\"%.0f\"/>\n",
+                comm_stat_names[ci],
+                result.comm_sum[ci],
+                comm_stat_names[ci],
+                result.comm_max[ci]);
+      fprintf(junit, "      </properties>\n");
+
+      for (int fi = 0; fi < result.fails.size(); ++fi)
+      {
+        const rank_fail& f = result.fails[fi];
+        fprintf(junit,
+                "      <failure message=\"%s\" type=\"assertion\">"
+                "%s line %d of %s\n%s</failure>\n",
+                xml_escape(f.test_string).c_str(),
+                format_fail_ranks(f).c_str(),
+                f.line,
+                xml_escape(f.file).c_str(),
+                xml_escape(f.reason).c_str());
+      }
+      if (!result.output.empty())
+      {
+        fprintf(junit, "      <system-out>");
+        for (int oi = 0; oi < result.output.size(); ++oi)
+          fprintf(junit,
+                  "--- output from proc %d ---\n%s",
+                  result.output[oi].rank,
+                  xml_escape(result.output[oi].text).c_str());
+        fprintf(junit, "</system-out>\n");
+      }
+      fprintf(junit, "    </testcase>\n");
+      fflush(junit);
+    }
+
+    if (json)
+    {
+      fprintf(json,
+              "{\"test\": \"%s\", \"procs\": %d, \"placement\": \"%s\", "
+              "\"nodes\": %d, \"status\": \"%s\", \"time\": %.9f, "
+              "\"runner_time\": %.9f",
+              json_escape(t.test_name).c_str(),
+              t.test_size,
+              placement_name((placement_mode)result.placement),
+              result.num_nodes,
+              result.fails.empty() ? "pass" : "fail",
+              result.time,
+              result.runner_time);
+      if (t.benchmark)
+        fprintf(json,
+                ", \"benchmark\": {\"min\": %.9f, \"median\": %.9f, "
+                "\"max\": %.9f, \"imbalance\": %.4f}",
+                result.bench_min,
+                result.bench_median,
+                result.bench_max,
+                result.bench_imbalance);
+      if (result.baseline > 0.)
+        fprintf(json, ", \"baseline\": %.9f", result.baseline);
+      if (t.calibration)
+        fprintf(json, ", \"calibration\": true");
+      if (t.calibration_bytes > 0. && result.bench_median > 0.)
+        fprintf(json,
+                ", \"bandwidth\": %.6e",
+                t.calibration_bytes / result.bench_median);
+      if (options.memory)
+      {
+        fprintf(json, ", \"memory\": {");
+        const char* separator = "";
+        for (int mi = 0; mi < num_mem_stats; ++mi)
+        {
+          if (!mem_stat_measured(mi))
+            continue;
+          fprintf(json,
+                  "%s\"%s\": {\"sum\": %.*f, \"max\": %.*f}",
+                  separator,
+                  mem_stat_name(mi, t).c_str(),
+                  mem_stat_precision(mi, t),
+                  result.mem_sum[mi],
+                  mem_stat_precision(mi, t),
+                  result.mem_max[mi]);
+          separator = ", ";
+        }
+        fprintf(json, "}");
+      }
+      if (comm_profiled)
+      {
+        fprintf(json, ", \"comm\": {");
+        for (int ci = 0; ci < num_comm_stats; ++ci)
+          fprintf(json,
+                  "%s\"%s\": {\"sum\": %.0f, \"max\": %.0f}",
+                  (ci > 0) ? ", " : "",
+                  comm_stat_names[ci],
+                  result.comm_sum[ci],
+                  result.comm_max[ci]);
+        fprintf(json, "}");
+      }
+
+      fprintf(json, ", \"failures\": [");
+      for (int fi = 0; fi < result.fails.size(); ++fi)
+      {
+        const rank_fail& f = result.fails[fi];
+        fprintf(json,
+                "%s{\"proc\": %d, \"procs\": \"%s\", \"count\": %d, "
+                "\"file\": \"%s\", \"line\": %d, \"assertion\": \"%s\", "
+                "\"reason\": \"%s\"}",
+                (fi > 0) ? ", " : "",
+                f.ranks[0],
+                format_ranks(f.ranks).c_str(),
+                f.count,
+                json_escape(f.file).c_str(),
+                f.line,
+                json_escape(f.test_string).c_str(),
+                json_escape(f.reason).c_str());
+      }
+      fprintf(json, "]");
+
+      if (!result.output.empty())
+      {
+        fprintf(json, ", \"output\": [");
+        for (int oi = 0; oi < result.output.size(); ++oi)
+          fprintf(json,
+                  "%s{\"proc\": %d, \"text\": \"%s\"}",
+                  (oi > 0) ? ", " : "",
+                  result.output[oi].rank,
+                  json_escape(result.output[oi].text).c_str());
+        fprintf(json, "]");
+      }
+
+      fprintf(json, "}\n");
+      fflush(json);
+    }
+  }
+
+  void report_writer::write_skipped(const test_info& t)
+  {
+    if (junit)
+    {
+      fprintf(junit,
+              "    <testcase name=\"%s\" classname=\"%s\" time=\"0\">\n"
+              "      <skipped message=\"needs more procs than launched\"/>\n"
+              "    </testcase>\n",
+              xml_escape(report_name(t, placement_packed)).c_str(),
+              xml_escape(t.test_name).c_str());
+      fflush(junit);
+    }
+
+    if (json)
+    {
+      fprintf(json,
+              "{\"test\": \"%s\", \"procs\": %d, \"status\": \"skipped\"}\n",
+              json_escape(t.test_name).c_str(),
+              t.test_size);
+      fflush(json);
+    }
+  }
+
+  // One record per node from the calibration's node check, JSON only since
+  // there's no test case to hang it on.
+  void report_writer::write_node(int node,
+                                 const std::string& host,
+                                 const std::vector<int>& ranks,
+                                 double bandwidth,
+                                 double latency,
+                                 bool outlier)
+  {
+    if (!json)
+      return;
+
+    fprintf(json,
+            "{\"calibration_node\": %d, \"host\": \"%s\", \"procs\": \"%s\", "
+            "\"copy_bandwidth\": %.6e, \"latency\": %.9f, \"outlier\": %s}\n",
+            node,
+            json_escape(host).c_str(),
+            format_ranks(ranks).c_str(),
+            bandwidth,
+            latency,
+            outlier ? "true" : "false");
+    fflush(json);
+  }
+
+  void report_writer::close()
+  {
+    if (junit)
+    {
+      fprintf(junit, "  </testsuite>\n</testsuites>\n");
+      fclose(junit);
+      junit = nullptr;
+    }
+
+    if (json)
+    {
+      fclose(json);
+      json = nullptr;
+    }
+  }
+
+  /* baselines */
+
+  // Benchmark medians by test name and then size. Only rank 0 ever reads or
+  // writes the baseline file. The file is a JSON object of objects, e.g.
+  //   {
+  //     "add_bench": {"1": 1.67e-03, "2": 1.68e-03}
+  //   }
+  typedef std::map<std::string, std::map<int, double>> baseline_map;
+
+  static void skip_space(const char*& at)
+  {
+    while (*at == ' ' || *at == '\t' || *at == '\n' || *at == '\r')
+      ++at;
+  }
+
+  static bool expect_char(const char*& at, char c)
+  {
+    skip_space(at);
+    if (*at != c)
+      return false;
+    ++at;
+    return true;
+  }
+
+  static bool parse_json_string(const char*& at, std::string& str)
+  {
+    if (!expect_char(at, '"'))
+      return false;
+    for (; *at && *at != '"'; ++at)
+    {
+      if (*at == '\\' && at[1])
+        ++at;
+      str += *at;
+    }
+    return expect_char(at, '"');
+  }
+
+  // Just enough JSON to read back what "write_baselines" writes (which is
+  // hopefully also what anyone editing the file by hand ends up with).
+  static bool parse_baselines(const char* at, baseline_map& baselines)
+  {
+    if (!expect_char(at, '{'))
+      return false;
+    skip_space(at);
+    if (*at == '}')
+      return true;
+
+    do
+    {
+      std::string name;
+      if (!parse_json_string(at, name) || !expect_char(at, ':') ||
+          !expect_char(at, '{'))
+        return false;
+
+      skip_space(at);
+      if (*at == '}')
+      {
+        ++at;
+        continue;
+      }
+
+      do
+      {
+        std::string size;
+        int test_size;
+        if (!parse_json_string(at, size) || !parse_int(size, test_size) ||
+            !expect_char(at, ':'))
+          return false;
+
+        skip_space(at);
+        char* end;
+        double median = strtod(at, &end);
+        if (end == at)
+          return false;
+        at                          = end;
+        baselines[name][test_size] = median;
+      } while (expect_char(at, ','));
+
+      if (!expect_char(at, '}'))
+        return false;
+    } while (expect_char(at, ','));
+
+    return expect_char(at, '}');
+  }
+
+  // A missing file is just an empty baseline, a broken one is an error.
+  static bool read_baselines(const std::string& path, baseline_map& baselines)
+  {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file)
+      return true;
+
+    std::string text;
+    char buff[4096];
+    size_t length;
+    while ((length = fread(buff, 1, sizeof(buff), file)) > 0)
+      text.append(buff, length);
+    fclose(file);
+
+    return parse_baselines(text.c_str(), baselines);
+  }
+
+  static void write_baselines(const std::string& path,
+                              const baseline_map& baselines)
+  {
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+    {
+      printf("couldn't open %s for writing!\n", path.c_str());
+      return;
+    }
+
+    fprintf(file, "{");
+    for (baseline_map::const_iterator bi = baselines.begin();
+         bi != baselines.end();
+         ++bi)
+    {
+      fprintf(file,
+              "%s\n  \"%s\": {",
+              (bi != baselines.begin()) ? "," : "",
+              json_escape(bi->first).c_str());
+      for (std::map<int, double>::const_iterator si = bi->second.begin();
+           si != bi->second.end();
+           ++si)
+        fprintf(file,
+                "%s\"%d\": %.9e",
+                (si != bi->second.begin()) ? ", " : "",
+                si->first,
+                si->second);
+      fprintf(file, "}");
+    }
+    fprintf(file, "\n}\n");
+    fclose(file);
+  }
+
+  // Records "result" in the cache entries of this run, a test that ran more
+  // than once (placements, repeats) failed if any run failed and took as
+  // long as its longest run.
+  static void cache_result(const test_result& result,
+                           test_list* list,
+                           result_cache& fresh)
+  {
+    const test_info& t = *list->tests[result.test];
+    std::pair<std::string, int> key(t.test_name, t.test_size);
+
+    result_cache::iterator it = fresh.find(key);
+    if (it == fresh.end())
+    {
+      cached_result& cached = fresh[key];
+      cached.build          = the_build_id;
+      cached.failed         = !result.fails.empty();
+      cached.time           = result.time;
+      return;
+    }
+    it->second.failed = it->second.failed || !result.fails.empty();
+    it->second.time   = std::max(it->second.time, result.time);
+  }
+
+  // Writes the old cache updated with everything that ran this time, so
+  // running a subset doesn't forget about the rest.
+  static void write_cache(const std::string& path, const result_cache& fresh)
+  {
+    result_cache cache = the_cache;
+    for (result_cache::const_iterator it = fresh.begin(); it != fresh.end();
+         ++it)
+      cache[it->first] = it->second;
+
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file)
+    {
+      printf("couldn't open %s for writing!\n", path.c_str());
+      return;
+    }
+    for (result_cache::const_iterator it = cache.begin(); it != cache.end();
+         ++it)
+      fprintf(file,
+              "%s %s %.9e %d %s\n",
+              it->second.build.c_str(),
+              it->second.failed ? "fail" : "pass",
+              it->second.time,
+              it->first.second,
+              it->first.first.c_str());
+    fclose(file);
+  }
+
+  // Compares a benchmark result against the baseline (when there is one) and
+  // fails it if it got too slow, or records it when updating the baseline.
+  static void check_baseline(test_result& result,
+                             test_list* list,
+                             baseline_map& baselines)
+  {
+    const test_info& t = *list->tests[result.test];
+    if (!t.benchmark)
+      return;
+
+    std::string name = placed_name(t, (placement_mode)result.placement);
+    if (options.update_baseline)
+    {
+      baselines[name][t.test_size] = result.bench_median;
+      return;
+    }
+
+    baseline_map::const_iterator bi = baselines.find(name);
+    if (bi == baselines.end())
+      return;
+    std::map<int, double>::const_iterator si = bi->second.find(t.test_size);
+    if (si == bi->second.end() || si->second <= 0.)
+      return;
+
+    result.baseline = si->second;
+    double slowdown = 100. * (result.bench_median / result.baseline - 1.);
+    if (slowdown <= options.baseline_tolerance)
+      return;
+
+    char reason[256];
+    snprintf(reason,
+             sizeof(reason),
+             "median %s is %.1f%% slower than the baseline %s (the tolerance "
+             "is %.1f%%)",
+             format_time(result.bench_median).c_str(),
+             slowdown,
+             format_time(result.baseline).c_str(),
+             options.baseline_tolerance);
+
+    rank_fail f;
+    f.ranks.push_back(0);
+    f.count       = 1;
+    f.line        = 0;
+    f.test_string = "BASELINE";
+    f.file        = options.baseline_path;
+    f.reason      = reason;
+    result.fails.push_back(f);
+  }
+
+  /* output capture */
+
+  // Redirects this processor's stdout and stderr (the file descriptors, so
+  // this catches printf, std::cout and anything else) into an anonymous
+  // temporary file while a test body runs. Everything gets flushed on the way
+  // in and out so nothing leaks across the boundary.
+  struct output_capture
+  {
+    FILE* file       = nullptr;
+    int saved_stdout = -1;
+    int saved_stderr = -1;
+
+    // Wherever stderr really goes, for whatever has to get out even while a
+    // capture is going on (the watchdog, which aborts before any captured
+    // output could ever be printed).
+    static std::atomic<int> original_stderr;
+
+    static void flush_all()
+    {
+      std::cout.flush();
+      std::cerr.flush();
+      fflush(stdout);
+      fflush(stderr);
+    }
+
+    void start()
+    {
+      flush_all();
+      file = tmpfile();
+      if (!file)
+        return;
+
+      saved_stdout = dup(STDOUT_FILENO);
+      saved_stderr = dup(STDERR_FILENO);
+      dup2(fileno(file), STDOUT_FILENO);
+      dup2(fileno(file), STDERR_FILENO);
+      original_stderr.store(saved_stderr);
+    }
+
+    // Puts everything back and returns whatever was printed.
+    std::string stop()
+    {
+      if (!file)
+        return "";
+
+      flush_all();
+      dup2(saved_stdout, STDOUT_FILENO);
+      dup2(saved_stderr, STDERR_FILENO);
+      original_stderr.store(STDERR_FILENO);
+      ::close(saved_stdout);
+      ::close(saved_stderr);
+
+      std::string text;
+      char buff[4096];
+      lseek(fileno(file), 0, SEEK_SET);
+      for (ssize_t n; (n = read(fileno(file), buff, sizeof(buff))) > 0;)
+        text.append(buff, n);
+
+      fclose(file);
+      file = nullptr;
+      return text;
+    }
+  };
+  std::atomic<int> output_capture::original_stderr(STDERR_FILENO);
+
+  /* hang detection */
+
+  // How much longer than the root the other processors of a timed out test
+  // wait before reporting, the root knows who's missing so it should get to
+  // report first. The watchdog below waits twice this so processors that
+  // made it out of the body report before the ones stuck in it.
+  static const double timeout_grace = 5.;
+
+  // Catches processors that are stuck inside a test body, the one case the
+  // polling in "await_arrival" can't handle because nothing on this processor
+  // ever gets there. A single thread is started the first time a test with a
+  // timeout runs and just sleeps until it's either disarmed or the deadline
+  // passes, at which point there's nothing left to do but report and abort.
+  // Note that calling MPI_Abort() from another thread is only strictly allowed
+  // with MPI_THREAD_MULTIPLE but we're going down anyway.
+  struct watchdog
+  {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+    bool running = false;
+    bool armed   = false;
+    std::chrono::steady_clock::time_point deadline;
+    const test_info* test = nullptr;
+    double seconds        = 0.;
+
+    void arm(const test_info& t, double timeout)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      if (!running)
+      {
+        running = true;
+        thread  = std::thread(&watchdog::watch, this);
+      }
+
+      std::chrono::duration<double> wait(timeout + 2. * timeout_grace);
+      deadline = std::chrono::steady_clock::now() +
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(wait);
+      test    = &t;
+      seconds = timeout;
+      armed   = true;
+      wake.notify_one();
+    }
+
+    void disarm()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      armed = false;
+      wake.notify_one();
+    }
+
+    // This must happen before MPI_Finalize().
+    void stop()
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!running)
+          return;
+        running = false;
+        wake.notify_one();
+      }
+      thread.join();
+    }
+
+    void watch()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (running)
+      {
+        if (!armed)
+        {
+          wake.wait(lock);
+          continue;
+        }
+
+        if (wake.wait_until(lock, deadline) == std::cv_status::timeout &&
+            armed && std::chrono::steady_clock::now() >= deadline)
+        {
+          int rank;
+          MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+          char message[512];
+          int length = snprintf(message,
+                                sizeof(message),
+                                "[ TIMEOUT ] %s (%d procs) still running on "
+                                "world proc %d well past its %.1f s timeout, "
+                                "aborting\n",
+                                test->test_name,
+                                test->test_size,
+                                rank,
+                                seconds);
+          length = std::min(length, (int)sizeof(message) - 1);
+          ::write(output_capture::original_stderr.load(), message, length);
+          MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+      }
+    }
+  };
+
+  static watchdog the_watchdog;
+
+  // Returns the timeout (in seconds, zero for none) that applies to a test.
+  static double test_timeout(const test_info& t)
+  {
+    return (t.timeout < 0.) ? options.timeout : t.timeout;
+  }
+
+  // Waits for every processor of a test to get through the body, giving up
+  // and aborting the whole run at "deadline" (an MPI_Wtime()). Each processor
+  // tells the root it's done with an empty message and then everyone polls a
+  // non-blocking barrier, so the root knows exactly who's missing if the
+  // deadline passes. This runs on the shape communicator so none of it can
+  // get mixed up with whatever the test body left behind on its own.
+  static void await_arrival(const test_info& t,
+                            MPI_Comm shape_comm,
+                            double deadline,
+                            double timeout)
+  {
+    const int arrival_tag = 0;
 
-namespace mpi_test
-{
-  test_list* test_list::instance()
+    int rank, size;
+    MPI_Comm_rank(shape_comm, &rank);
+    MPI_Comm_size(shape_comm, &size);
+
+    std::vector<MPI_Request> arrivals;
+    if (rank == 0)
+    {
+      arrivals.resize(size - 1);
+      for (int ri = 1; ri < size; ++ri)
+        MPI_Irecv(nullptr,
+                  0,
+                  MPI_CHAR,
+                  ri,
+                  arrival_tag,
+                  shape_comm,
+                  &arrivals[ri - 1]);
+    }
+    else
+    {
+      arrivals.resize(1);
+      MPI_Isend(nullptr, 0, MPI_CHAR, 0, arrival_tag, shape_comm, &arrivals[0]);
+    }
+
+    MPI_Request barrier;
+    MPI_Ibarrier(shape_comm, &barrier);
+
+    double give_up = deadline + ((rank == 0) ? 0. : timeout_grace);
+    int done       = 0;
+    while (true)
+    {
+      MPI_Test(&barrier, &done, MPI_STATUS_IGNORE);
+      if (done)
+        break;
+
+      if (MPI_Wtime() > give_up)
+      {
+        std::string who = "proc 0";
+        if (rank == 0)
+        {
+          std::vector<int> missing;
+          for (int ri = 1; ri < size; ++ri)
+          {
+            int arrived;
+            MPI_Test(&arrivals[ri - 1], &arrived, MPI_STATUS_IGNORE);
+            if (!arrived)
+              missing.push_back(ri);
+          }
+          who = "procs " + format_ranks(missing);
+        }
+
+        printf("[ TIMEOUT ] %s (%d procs) took longer than %.1f s, still "
+               "waiting on %s of the test, aborting\n",
+               t.test_name,
+               t.test_size,
+               timeout,
+               who.c_str());
+        fflush(stdout);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+      }
+
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    MPI_Waitall((int)arrivals.size(), arrivals.data(), MPI_STATUSES_IGNORE);
+  }
+
+  /* running */
+
+  static double median(std::vector<double> values)
   {
-    static test_list list;
-    return &list;
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    if (n % 2 == 1)
+      return values[n / 2];
+    return 0.5 * (values[n / 2 - 1] + values[n / 2]);
   }
 
-  test_ptr add_test(test_ptr test,
-                    std::initializer_list<int> test_sizes,
-                    const char* name)
+  // How many times a benchmark body runs untimed and then timed.
+  static int benchmark_warmup(const test_info& t)
   {
-    for (int test_size : test_sizes)
-      test_list::instance()->tests.push_back({test, test_size, name});
-    return test;
+    return (t.warmup < 0) ? options.warmup : t.warmup;
   }
 
-  void register_error(const assert_info assertion, std::string reason)
+  static int benchmark_iterations(const test_info& t)
   {
-    test_list* list = test_list::instance();
-    list->tests[list->current_test].fails.push_back({assertion, reason});
+    return (t.iterations < 1) ? options.iterations : t.iterations;
+  }
+
+  // Runs a benchmark body "warmup" times untimed and then "iterations" times
+  // timed, with a barrier on either side of every run so all processors start
+  // each run together. The per processor median run time is reduced across
+  // the test communicator into "result" on the root.
+  static void run_benchmark(test_info& this_test,
+                            MPI_Comm test_comm,
+                            test_result& result)
+  {
+    int rank, size;
+    MPI_Comm_rank(test_comm, &rank);
+    MPI_Comm_size(test_comm, &size);
+
+    int warmup     = benchmark_warmup(this_test);
+    int iterations = benchmark_iterations(this_test);
+
+    // Failures only get recorded for the first run, every run after that
+    // would just register the same thing again.
+    std::vector<fail_info>& fails = test_list::instance()->fails;
+    size_t num_first_fails        = 0;
+
+    std::vector<double> times(iterations);
+    for (int it = 0; it < warmup + iterations; ++it)
+    {
+      PMPI_Barrier(test_comm);
+      double start = MPI_Wtime();
+      run_body(this_test, test_comm);
+      double elapsed = MPI_Wtime() - start;
+      PMPI_Barrier(test_comm);
+
+      if (it >= warmup)
+        times[it - warmup] = elapsed;
+
+      if (it == 0)
+        num_first_fails = fails.size();
+      while (fails.size() > num_first_fails)
+        fails.pop_back();
+    }
+
+    double local_median = median(times);
+    std::vector<double> medians(rank == 0 ? size : 0);
+    PMPI_Gather(&local_median,
+                1,
+                MPI_DOUBLE,
+                medians.data(),
+                1,
+                MPI_DOUBLE,
+                0,
+                test_comm);
+
+    if (rank == 0)
+    {
+      double sum = 0.;
+      for (int ri = 0; ri < size; ++ri)
+        sum += medians[ri];
+      double mean = sum / size;
+
+      result.bench_min    = *std::min_element(medians.begin(), medians.end());
+      result.bench_max    = *std::max_element(medians.begin(), medians.end());
+      result.bench_median = median(medians);
+      result.bench_imbalance = (mean > 0.) ? result.bench_max / mean : 1.;
+    }
+  }
+
+  // The high water mark of the resident set of this processor in bytes, the
+  // "VmHWM" line of /proc/self/status. Always zero where that doesn't exist.
+  static double peak_rss()
+  {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file)
+      return 0.;
+
+    double bytes = 0.;
+    char line[256];
+    unsigned long long kib;
+    while (fgets(line, sizeof(line), file))
+    {
+      if (sscanf(line, "VmHWM: %llu kB", &kib) == 1)
+      {
+        bytes = 1024. * kib;
+        break;
+      }
+    }
+    fclose(file);
+    return bytes;
+  }
+
+  // Brings the high water mark back down to what's resident right now, where
+  // the kernel lets us (writing 5 to /proc/self/clear_refs). Where it doesn't
+  // the peak of a test is only seen if it's above every peak before it.
+  static void reset_peak_rss()
+  {
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if (!file)
+      return;
+    fputs("5", file);
+    fclose(file);
+  }
+
+  // Runs a single test on "test_comm" and collects its failure information on
+  // the root of "test_comm". The returned result is only meaningful on the
+  // root.
+  // The test gets its own duplicate of "shape_comm" (the cached communicator
+  // for its slot) to run on. Both the time spent in the body and the time the
+  // runner spends around it (communicator setup and result collection) are
+  // recorded as the max over the processors of the test.
+  static test_result run_test(test_info& this_test, MPI_Comm shape_comm)
+  {
+    test_result result = {};
+    result.test        = test_list::instance()->current_test;
+
+    double runner_start = MPI_Wtime();
+
+    MPI_Comm test_comm;
+    MPI_Comm_dup(shape_comm, &test_comm);
+
+    double timeout = test_timeout(this_test);
+    if (timeout > 0.)
+      the_watchdog.arm(this_test, timeout);
+
+    output_capture capture;
+    if (!options.capture.empty())
+      capture.start();
+
+    alloc_stats mem_start = {};
+    double rss_start      = 0.;
+    if (options.memory)
+    {
+      reset_peak_bytes();
+      mem_start = current_alloc_stats();
+      reset_peak_rss();
+      rss_start = peak_rss();
+    }
+
+    comm_stats comm_start = current_comm_stats();
+    comm_counting.store(true, std::memory_order_relaxed);
+
+    // run the test, only the body itself gets its allocations counted (see
+    // "run_body")
+    double test_start = MPI_Wtime();
+    alloc_stats mem_end;
+    {
+      runner_allocations paused;
+      if (this_test.benchmark)
+        run_benchmark(this_test, test_comm, result);
+      else if (this_test.threads > 1)
+        run_team(this_test, test_comm);
+      else
+        run_body(this_test, test_comm);
+      mem_end = current_alloc_stats();
+    }
+    double test_time = MPI_Wtime() - test_start;
+
+    comm_counting.store(false, std::memory_order_relaxed);
+    comm_stats comm_end = current_comm_stats();
+
+    double mem[num_mem_stats] = {};
+    if (options.memory)
+    {
+      mem[mem_allocations] =
+      (double)(mem_end.num_allocations - mem_start.num_allocations);
+      mem[mem_allocated] = (double)(mem_end.num_bytes - mem_start.num_bytes);
+      mem[mem_peak_heap] = (double)(mem_end.peak_bytes - mem_start.live_bytes);
+      mem[mem_peak_rss] = peak_rss() - rss_start;
+      mem[mem_live_at_exit] =
+      (double)mem_end.live_bytes - (double)mem_start.live_bytes;
+
+      if (this_test.benchmark)
+      {
+        int runs =
+        benchmark_warmup(this_test) + benchmark_iterations(this_test);
+        mem[mem_allocations] /= runs;
+        mem[mem_allocated] /= runs;
+      }
+    }
+
+    std::string output = capture.stop();
+
+    // With a timeout nobody goes into the (blocking) result collection until
+    // everyone is known to have finished the body.
+    if (timeout > 0.)
+    {
+      the_watchdog.disarm();
+      await_arrival(this_test, shape_comm, test_start + timeout, timeout);
+    }
+
+    // Since all failure information must be printed from a single process (I
+    // don't believe print synchronization works across processes even if the
+    // processes issue print commands in order due to buffer flushing issues)
+    // everything is collected on the root of the test communicator.
+    std::vector<fail_info>& fails = test_list::instance()->fails;
+    result.fails                  = reduce_fails(fails, test_comm);
+    fails.clear();
+
+    if (options.memory)
+    {
+      MPI_Reduce(
+      mem, result.mem_sum, num_mem_stats, MPI_DOUBLE, MPI_SUM, 0, test_comm);
+      MPI_Reduce(
+      mem, result.mem_max, num_mem_stats, MPI_DOUBLE, MPI_MAX, 0, test_comm);
+    }
+
+    if (comm_profiled)
+    {
+      double comm[num_comm_stats] = {
+      (double)(comm_end.num_messages - comm_start.num_messages),
+      (double)(comm_end.num_bytes - comm_start.num_bytes),
+      (double)(comm_end.num_collectives - comm_start.num_collectives)};
+      MPI_Reduce(comm,
+                 result.comm_sum,
+                 num_comm_stats,
+                 MPI_DOUBLE,
+                 MPI_SUM,
+                 0,
+                 test_comm);
+      MPI_Reduce(comm,
+                 result.comm_max,
+                 num_comm_stats,
+                 MPI_DOUBLE,
+                 MPI_MAX,
+                 0,
+                 test_comm);
+    }
+
+    if (!options.capture.empty())
+    {
+      std::vector<std::string> outputs = gather_buffers(output, test_comm);
+      if (options.capture == "all" || !result.fails.empty())
+      {
+        for (int ri = 0; ri < outputs.size(); ++ri)
+        {
+          if (!outputs[ri].empty())
+            result.output.push_back({ri, outputs[ri]});
+        }
+      }
+    }
+
+    MPI_Comm_free(&test_comm);
+
+    double times[2] = {test_time, MPI_Wtime() - runner_start - test_time};
+    double max_times[2];
+    MPI_Reduce(times, max_times, 2, MPI_DOUBLE, MPI_MAX, 0, shape_comm);
+    result.time        = max_times[0];
+    result.runner_time = max_times[1];
+
+    return result;
+  }
+
+  // Collects the results from the root (first rank) of every slot in "wave"
+  // on rank 0 of MPI_COMM_WORLD, everyone else just contributes nothing (an
+  // empty "packed"). The results come back in schedule order.
+  static std::vector<test_result> collect_results(const std::string& packed,
+                                                  const wave& this_wave)
+  {
+    std::vector<std::string> buffs = gather_buffers(packed, MPI_COMM_WORLD);
+
+    std::vector<test_result> results;
+    for (int si = 0; si < this_wave.size() && !buffs.empty(); ++si)
+    {
+      const char* cursor = buffs[this_wave[si].ranks[0]].data();
+      results.push_back(unpack_result(cursor));
+    }
+    return results;
+  }
+
+  /* calibration */
+
+  // A node is flagged when its memory bandwidth is below the median over all
+  // nodes divided by this, or its ping-pong latency above the median times
+  // this.
+  static const double outlier_factor = 2.;
+
+  static const int calibration_tag = 4243;
+
+  // The calibration tests that fit in this job, there's no point in
+  // reporting all the sizes that don't as skipped.
+  static std::vector<int> select_calibration(test_list* list, int size)
+  {
+    std::vector<int> selected;
+    for (int ti = 0; ti < list->tests.size(); ++ti)
+    {
+      if (list->tests[ti]->calibration && list->tests[ti]->test_size <= size)
+        selected.push_back(ti);
+    }
+    return selected;
+  }
+
+  // Seconds per round trip of 8 bytes between this world rank and "partner",
+  // after one round trip to get going.
+  static double pingpong_latency(int rank, int partner)
+  {
+    const int reps = 100;
+    char buff[8]   = {};
+
+    double start = 0.;
+    for (int it = 0; it <= reps; ++it)
+    {
+      if (it == 1)
+        start = MPI_Wtime();
+
+      if (rank < partner)
+      {
+        MPI_Send(
+        buff, 8, MPI_CHAR, partner, calibration_tag, MPI_COMM_WORLD);
+        MPI_Recv(buff,
+                 8,
+                 MPI_CHAR,
+                 partner,
+                 calibration_tag,
+                 MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+      }
+      else
+      {
+        MPI_Recv(buff,
+                 8,
+                 MPI_CHAR,
+                 partner,
+                 calibration_tag,
+                 MPI_COMM_WORLD,
+                 MPI_STATUS_IGNORE);
+        MPI_Send(
+        buff, 8, MPI_CHAR, partner, calibration_tag, MPI_COMM_WORLD);
+      }
+    }
+    return (MPI_Wtime() - start) / reps;
+  }
+
+  // Bytes per second this proc copies while every other proc of the job
+  // copies at the same time (like they would during a test), best of a few.
+  static double copy_bandwidth()
+  {
+    const size_t n = 1 << 20;
+    std::vector<double> src(n, 1.), dst(n, 0.);
+
+    MPI_Barrier(MPI_COMM_WORLD);
+    double best = 0.;
+    for (int it = 0; it < 5; ++it)
+    {
+      double start = MPI_Wtime();
+      memcpy(dst.data(), src.data(), n * sizeof(double));
+      double elapsed = MPI_Wtime() - start;
+      if (it == 0 || elapsed < best)
+        best = elapsed;
+
+      // so the copies can't be optimized away
+      src[it] = dst[n - 1 - it];
+    }
+    return (best > 0.) ? n * sizeof(double) / best : 0.;
+  }
+
+  // Checks every node of the job before anything else runs: how fast its
+  // procs copy memory and (with more than one node) the ping-pong latency to
+  // another node, measured between the lowest ranks of pairs of nodes. Nodes
+  // far off the median are flagged, everything goes to the JSON report.
+  // Collective over MPI_COMM_WORLD.
+  static void check_nodes(const topology& topo, report_writer& reports)
+  {
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    std::vector<int> leader_of(topo.num_nodes, size);
+    for (int ri = 0; ri < size; ++ri)
+      leader_of[topo.node_of[ri]] = std::min(leader_of[topo.node_of[ri]], ri);
+    int node    = topo.node_of[rank];
+    bool leader = (leader_of[node] == rank);
+
+    double measured[2] = {copy_bandwidth(), 0.};
+
+    // Nodes pair up 0-1, 2-3 and so on, with an odd number of them the last
+    // one goes with node 0 afterwards (which keeps its first latency).
+    if (leader && topo.num_nodes > 1)
+    {
+      int last = topo.num_nodes - 1;
+      if ((node ^ 1) < topo.num_nodes)
+        measured[1] = pingpong_latency(rank, leader_of[node ^ 1]);
+      if (topo.num_nodes % 2 == 1 && node == last)
+        measured[1] = pingpong_latency(rank, leader_of[0]);
+      else if (topo.num_nodes % 2 == 1 && node == 0)
+        pingpong_latency(rank, leader_of[last]);
+    }
+
+    std::vector<double> all(rank == 0 ? 2 * size : 0);
+    MPI_Gather(
+    measured, 2, MPI_DOUBLE, all.data(), 2, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+
+    std::string host;
+    if (leader)
+    {
+      char name[MPI_MAX_PROCESSOR_NAME];
+      int length;
+      MPI_Get_processor_name(name, &length);
+      host.assign(name, length);
+    }
+    std::vector<std::string> hosts = gather_buffers(host, MPI_COMM_WORLD);
+
+    if (rank != 0)
+      return;
+
+    // a node is as fast as its slowest proc
+    std::vector<std::vector<int>> ranks(topo.num_nodes);
+    std::vector<double> bandwidths(topo.num_nodes, 0.);
+    std::vector<double> latencies(topo.num_nodes, 0.);
+    for (int ri = 0; ri < size; ++ri)
+    {
+      int n = topo.node_of[ri];
+      if (ranks[n].empty() || all[2 * ri] < bandwidths[n])
+        bandwidths[n] = all[2 * ri];
+      ranks[n].push_back(ri);
+      if (ri == leader_of[n])
+        latencies[n] = all[2 * ri + 1];
+    }
+
+    double median_bandwidth = median(bandwidths);
+    double median_latency   = (topo.num_nodes > 1) ? median(latencies) : 0.;
+
+    printf("[ CALIB   ] %d node%s, memory copy %s/s per proc",
+           topo.num_nodes,
+           (topo.num_nodes > 1) ? "s" : "",
+           format_bytes(median_bandwidth).c_str());
+    if (topo.num_nodes > 1)
+      printf(", ping-pong latency %s between nodes",
+             format_time(median_latency).c_str());
+    printf(" (node medians)\n");
+
+    for (int n = 0; n < topo.num_nodes; ++n)
+    {
+      bool outlier = bandwidths[n] * outlier_factor < median_bandwidth ||
+                     latencies[n] > median_latency * outlier_factor;
+      if (outlier)
+      {
+        printf("[ OUTLIER ] node %d (%s, procs %s) memory copy %s/s per proc",
+               n,
+               hosts[leader_of[n]].c_str(),
+               format_ranks(ranks[n]).c_str(),
+               format_bytes(bandwidths[n]).c_str());
+        if (topo.num_nodes > 1)
+          printf(", ping-pong latency %s", format_time(latencies[n]).c_str());
+        printf("\n");
+      }
+      reports.write_node(n,
+                         hosts[leader_of[n]],
+                         ranks[n],
+                         bandwidths[n],
+                         latencies[n],
+                         outlier);
+    }
+    printf("\n");
+    fflush(stdout);
   }
 
 }  // namespace mpi_test
@@ -34,192 +3733,337 @@ int main(int argc, char** argv)
   /* initialize and make a little space */
 
   int rank, size;
-  MPI_Init(&argc, &argv);
+  MPI_Init_thread(&argc,
+                  &argv,
+                  mpi_test::requested_thread_level(argc, argv),
+                  &mpi_test::provided_thread_level);
   MPI_Comm_rank(MPI_COMM_WORLD, &rank);
   MPI_Comm_size(MPI_COMM_WORLD, &size);
 
   mpi_test::test_list* list = mpi_test::test_list::instance();
+  mpi_test::link_calibration();
+  mpi_test::index_tests(list);
+
+  std::string error;
+  if (!mpi_test::parse_options(argc, argv, error))
+  {
+    if (rank == 0)
+      printf("%s", error.c_str());
+
+    MPI_Finalize();
+    return 0;
+  }
+
+  if (mpi_test::provided_thread_level < mpi_test::options.thread_level)
+  {
+    if (rank == 0)
+      printf("asked for --thread-level=%s but MPI only provides %s\n",
+             mpi_test::thread_level_str(mpi_test::options.thread_level),
+             mpi_test::thread_level_str(mpi_test::provided_thread_level));
+
+    MPI_Finalize();
+    return 1;
+  }
 
   if (rank == 0)
     printf("\n\n");
 
   MPI_Barrier(MPI_COMM_WORLD);
 
-  /* ensure the program was launched with enough procs */
+  /* pick the tests to run */
 
   // Note that all processors generate the same test list during dynamic
-  // initialization (at least I think that's how it works). Each processor needs
-  // to do the work of finding the largest test so they all hit the
-  // MPI_Finalize() in the case of an incorrect launch size (without
-  // communication, that is).
+  // initialization (at least I think that's how it works) and parse the same
+  // command line, so they all select the same tests without any
+  // communication. Tests that aren't selected cost nothing.
+
+  if (!mpi_test::options.cache_path.empty())
+    mpi_test::load_cache(mpi_test::options.cache_path, mpi_test::the_cache);
+
+  std::vector<int> selected =
+  mpi_test::shard_tests(list, mpi_test::select_tests(list));
+  mpi_test::order_tests(list, selected);
+
+  // The node layout is the one thing every processor does need to agree on
+  // (over MPI_COMM_WORLD) before scheduling.
+  mpi_test::topology topo = mpi_test::find_topology();
 
-  int largest_test_size = 0;
-  for (int ti = 0; ti < list->tests.size(); ++ti)
+  // Only rank 0 ever writes reports (or reads baselines).
+  mpi_test::report_writer reports;
+  mpi_test::baseline_map baselines;
+  if (rank == 0)
   {
-    if (list->tests[ti].test_size > largest_test_size)
-      largest_test_size = list->tests[ti].test_size;
+    reports.open();
+
+    if (!mpi_test::options.baseline_path.empty() &&
+        !mpi_test::read_baselines(mpi_test::options.baseline_path, baselines))
+    {
+      printf("couldn't parse the baseline %s, ignoring it!\n",
+             mpi_test::options.baseline_path.c_str());
+      baselines.clear();
+    }
   }
 
-  if (size < largest_test_size)
-  {
-    if (rank == 0)
-      printf("please launch with at least %d procs!\n", largest_test_size);
+  /* skip tests that don't fit */
 
-    MPI_Finalize();
-    return 0;
+  // Tests that need more procs than this job has are skipped (and reported)
+  // rather than taking down the whole run. Again every processor does this on
+  // its own so no communication is needed.
+
+  std::vector<int> runnable;
+  for (int si = 0; si < selected.size(); ++si)
+  {
+    const mpi_test::test_info& t = *list->tests[selected[si]];
+    if (t.test_size <= size)
+    {
+      runnable.push_back(selected[si]);
+    }
+    else if (rank == 0)
+    {
+      printf("[ SKIPPED ] %s (needs %d procs, launched with %d)\n",
+             t.test_name,
+             t.test_size,
+             size);
+      reports.write_skipped(t);
+    }
   }
+  selected.swap(runnable);
 
   MPI_Barrier(MPI_COMM_WORLD);
 
-  /* run each test */
-
-  for (int ti = 0; ti < list->tests.size(); ++ti)
-  {
-    // This is a reference because all test information resides in the single
-    // test_list instance.
-    mpi_test::test_info& this_test = list->tests[ti];
-
-    // The error registration routine needs the current test to be set in the
-    // (single) test list instance to assign failure information to the correct
-    // test, so it's set here.
-    // Maybe this should actually be passed through in the future...
-    list->current_test = ti;
-
-    // Make communicator for this test.
-    // Each test runs using it's own communicator, this is critical so that the
-    // test code and mpi_test to not interfere with each other. Communicator
-    // splitting is used here, the lowest [proc count] processors are actually
-    // used in any given test. The two new communicators are differentiated by
-    // using the processor's rank in MPI_COMM_WORLD in this routine.
-    int color = 0;
-    if (rank < this_test.test_size)
-      color = 1;
-    MPI_Comm test_comm;
-    MPI_Comm_split(MPI_COMM_WORLD, color, rank, &test_comm);
+  /* calibrate */
+
+  // The node check runs right away, the calibration benchmarks as the first
+  // waves of the first pass.
+  std::vector<mpi_test::wave> calibration_waves;
+  if (mpi_test::options.calibrate)
+  {
+    mpi_test::check_nodes(topo, reports);
+    calibration_waves = mpi_test::schedule(
+    list,
+    mpi_test::place_tests(list, mpi_test::select_calibration(list, size)),
+    topo);
+  }
+
+  /* run each wave of tests */
+
+  // With a repeated run the whole schedule runs over and over inside this
+  // one MPI session, and since the communicator cache is keyed by ranks the
+  // repeats don't split anything again (unless a shuffle moves tests onto
+  // ranks that never ran together before). Only the first pass is printed
+  // in full, later ones just their failures.
+  bool repeating = mpi_test::options.repeat_set || mpi_test::options.until_fail;
+  int num_passes = mpi_test::options.repeat;
+  if (mpi_test::options.until_fail && !mpi_test::options.repeat_set)
+    num_passes = std::numeric_limits<int>::max();
 
-    // Run this test on the appropriate number of procs (within the test_comm).
-    // Other processors fall through and stop at the barrier.
-    if (rank < this_test.test_size)
+  // Every processor has to shuffle the same way so an unseeded shuffle uses
+  // rank 0's clock.
+  if (mpi_test::options.shuffle)
+  {
+    if (!mpi_test::options.seed_set)
     {
-      // start of test print
-      if (rank == 0)
+      mpi_test::options.shuffle_seed = (unsigned)
+      std::chrono::steady_clock::now().time_since_epoch().count();
+      MPI_Bcast(
+      &mpi_test::options.shuffle_seed, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+    }
+    if (rank == 0)
+      printf("shuffling with --shuffle=%u\n\n", mpi_test::options.shuffle_seed);
+  }
+  std::mt19937 shuffle_rng(mpi_test::options.shuffle_seed);
+
+  mpi_test::comm_cache comms;
+
+  // Rank 0 keeps every result of the first pass around for the summaries at
+  // the end, without their failures these are small (a test index and some
+  // timings).
+  std::vector<mpi_test::test_result> all_results;
+  mpi_test::failure_rates rates;
+  mpi_test::result_cache fresh_cache;
+
+  int pass = 0;
+  for (; pass < num_passes; ++pass)
+  {
+    if (mpi_test::options.shuffle)
+      std::shuffle(selected.begin(), selected.end(), shuffle_rng);
+
+    std::vector<mpi_test::wave> waves =
+    mpi_test::schedule(list, mpi_test::place_tests(list, selected), topo);
+    if (pass == 0)
+      waves.insert(
+      waves.begin(), calibration_waves.begin(), calibration_waves.end());
+
+    if (repeating && rank == 0)
+    {
+      printf("[ REPEAT  ] pass %d\n", pass + 1);
+      fflush(stdout);
+    }
+
+    int pass_failed = 0;
+
+    // The last wave each suite fixture (by shape) gets used in, it's released
+    // right after that.
+    std::map<mpi_test::comm_cache::fixture_key, int> last_use;
+    for (int wi = 0; wi < waves.size(); ++wi)
+    {
+      for (int si = 0; si < waves[wi].size(); ++si)
       {
-        const char* plural = (this_test.test_size > 1) ? "s" : "";
-        printf("[ RUNNING ] %s (%d proc%s)\n",
-               this_test.test_name,
-               this_test.test_size,
-               plural);
+        const mpi_test::slot& s = waves[wi][si];
+        if (list->tests[s.test]->fixture)
+          last_use[mpi_test::comm_cache::fixture_key(
+          list->tests[s.test]->fixture, s.ranks)] = wi;
       }
+    }
 
-      // run the test
-      this_test.fptr(test_comm);
+    for (int wi = 0; wi < waves.size(); ++wi)
+    {
+      const mpi_test::wave& this_wave = waves[wi];
 
-      // Since all failure information must be printed from a single process (I
-      // don't believe print synchronization works across processes even if the
-      // processes issue print commands in order due to buffer flushing issues)
-      // and you don't have to communicate anything if there's no failure, the
-      // number of failures on each process is communicated back in advance
-      // here.
-      int* num_fails_by_rank;
-      if (rank == 0)
-        num_fails_by_rank = new int[this_test.test_size];
-
-      int num_fails_local = (int)this_test.fails.size();
-      MPI_Gather(&num_fails_local,
-                 1,
-                 MPI_INT,
-                 num_fails_by_rank,
-                 1,
-                 MPI_INT,
-                 0,
-                 test_comm);
+      // Find the slot (if any) this processor belongs to in this wave. Ranks
+      // past the end of the last slot sit this wave out.
+      int my_slot = -1;
+      for (int si = 0; si < this_wave.size(); ++si)
+      {
+        const std::vector<int>& ranks = this_wave[si].ranks;
+        if (std::find(ranks.begin(), ranks.end(), rank) != ranks.end())
+          my_slot = si;
+      }
 
-      // give a success print if there were no failures
-      int num_fails_total = 0;
-      if (rank == 0)
+      // Rank 0 knows the whole schedule so it can announce everything in the
+      // wave up front, before any of it starts running.
+      if (rank == 0 && pass == 0)
       {
-        for (int ri = 0; ri < this_test.test_size; ++ri)
-          num_fails_total += num_fails_by_rank[ri];
-
-        if (num_fails_total == 0)
-          printf("[ SUCCESS ] %s\n", this_test.test_name);
-      }
-
-      // Note that in this next section nothing will be sent, received, or
-      // printed if there are no failures, things will just fall through to the
-      // next barrier. There might be a better way to do this hmm.
-
-      // Compile an error message locally and send to the root process if there
-      // were failures. Failure message numbers are stored in the tag so there's
-      // no confusion with the messages.
-      MPI_Request* requests = new MPI_Request[this_test.fails.size()];
-      MPI_Status* statuses  = new MPI_Status[this_test.fails.size()];
-      char* error_message_send_buff =
-      new char[FAIL_MESSAGE_SIZE * this_test.fails.size()];
-      for (int fi = 0; fi < this_test.fails.size(); ++fi)
-      {
-        snprintf(error_message_send_buff + (FAIL_MESSAGE_SIZE * fi),
-                 FAIL_MESSAGE_SIZE,
-                 "  %s FAILED (on proc %d line %d of %s)\n    %s",
-                 this_test.fails[fi].assertion.test_string,
-                 rank,
-                 this_test.fails[fi].assertion.line,
-                 this_test.fails[fi].assertion.file,
-                 this_test.fails[fi].reason.c_str());
-
-        MPI_Issend(error_message_send_buff + (FAIL_MESSAGE_SIZE * fi),
-                   FAIL_MESSAGE_SIZE,
-                   MPI_CHAR,
-                   0,
-                   fi,
-                   test_comm,
-                   &requests[fi]);
-      }
-
-      // On the root process, recieve and print all error messages in order.
+        for (int si = 0; si < this_wave.size(); ++si)
+        {
+          const mpi_test::slot& s      = this_wave[si];
+          const mpi_test::test_info& t = *list->tests[s.test];
+          const char* plural           = (t.test_size > 1) ? "s" : "";
+          std::string threads =
+          (t.threads > 1) ? " x " + std::to_string(t.threads) + " threads"
+                          : "";
+          printf("[ RUNNING ] %s (%d proc%s%s, %s on rank%s %s)\n",
+                 t.test_name,
+                 t.test_size,
+                 plural,
+                 threads.c_str(),
+                 mpi_test::placement_name(s.placement),
+                 plural,
+                 mpi_test::format_ranks(s.ranks).c_str());
+        }
+        fflush(stdout);
+      }
+
+      std::string packed;
+      if (my_slot >= 0)
+      {
+        const mpi_test::slot& s = this_wave[my_slot];
+        int ti                  = s.test;
+
+        // Each test runs using it's own communicator, this is critical so that
+        // the test code and mpi_test to not interfere with each other. The
+        // communicator for the slot's ranks comes from the cache and
+        // "run_test" duplicates it so each test still gets a fresh one.
+        MPI_Comm shape_comm = comms.get(s.ranks);
+
+        // The error registration routine needs the current test to be set in
+        // the (single) test list instance to assign failure information to the
+        // correct test, so it's set here.
+        // Maybe this should actually be passed through in the future...
+        list->current_test = ti;
+
+        // Suite fixtures are built outside of the test's timing (and its
+        // memory and communication counts).
+        const mpi_test::fixture_info* fixture = list->tests[ti]->fixture;
+        list->fixture = fixture ? comms.fixture(fixture, s.ranks) : nullptr;
+
+        mpi_test::test_result result =
+        mpi_test::run_test(*list->tests[ti], shape_comm);
+
+        list->fixture = nullptr;
+        if (fixture &&
+            last_use[mpi_test::comm_cache::fixture_key(fixture, s.ranks)] == wi)
+          comms.release_fixture(fixture, s.ranks);
+
+        if (rank == s.ranks[0])
+        {
+          std::vector<int> nodes;
+          for (int ri = 0; ri < s.ranks.size(); ++ri)
+            nodes.push_back(topo.node_of[s.ranks[ri]]);
+          std::sort(nodes.begin(), nodes.end());
+          result.placement = s.placement;
+          result.num_nodes =
+          (int)(std::unique(nodes.begin(), nodes.end()) - nodes.begin());
+          mpi_test::pack_result(packed, result);
+        }
+      }
+
+      // This is collective over MPI_COMM_WORLD so it also keeps waves from
+      // overlapping.
+      std::vector<mpi_test::test_result> results =
+      mpi_test::collect_results(packed, this_wave);
+
       if (rank == 0)
       {
-        for (int ri = 0; ri < this_test.test_size; ++ri)
+        for (int ri = 0; ri < results.size(); ++ri)
         {
-          for (int fi = 0; fi < num_fails_by_rank[ri]; ++fi)
+          mpi_test::check_baseline(results[ri], list, baselines);
+          if (pass == 0 || !results[ri].fails.empty())
+            mpi_test::print_result(results[ri], list);
+          reports.write(results[ri], list);
+
+          if (!list->tests[results[ri].test]->calibration)
           {
-            char error_message_recv[FAIL_MESSAGE_SIZE];
-
-            MPI_Status status;
-            MPI_Recv(error_message_recv,
-                     FAIL_MESSAGE_SIZE,
-                     MPI_CHAR,
-                     ri,
-                     fi,
-                     test_comm,
-                     &status);
-            printf("%s\n", error_message_recv);
+            mpi_test::count_failures(results[ri], rates);
+            mpi_test::cache_result(results[ri], list, fresh_cache);
           }
+          if (!results[ri].fails.empty())
+            pass_failed = 1;
+
+          results[ri].fails.clear();
+          if (pass == 0)
+            all_results.push_back(results[ri]);
         }
+        fflush(stdout);
       }
+    }
 
-      // Ensure all of your messages are received before freeing the send
-      // buffer, the send buffer needs to stick around until the communication
-      // completes.
-      MPI_Waitall(this_test.fails.size(), requests, statuses);
-      delete[] requests;
-      delete[] statuses;
-      delete[] error_message_send_buff;
-      if (rank == 0)
-        delete[] num_fails_by_rank;
-
-      // end of test print
-      if (rank == 0 && num_fails_total != 0)
-        printf("[ FAIL    ] %s\n", this_test.test_name);
+    // Everybody has to agree on whether to keep going.
+    if (mpi_test::options.until_fail)
+    {
+      MPI_Bcast(&pass_failed, 1, MPI_INT, 0, MPI_COMM_WORLD);
+      if (pass_failed)
+      {
+        ++pass;
+        break;
+      }
     }
+  }
 
-    MPI_Barrier(MPI_COMM_WORLD);
+  /* summaries */
 
-    MPI_Comm_free(&test_comm);
+  if (rank == 0)
+  {
+    mpi_test::print_slowest(all_results, list);
+    mpi_test::print_scaling(all_results, list);
+    if (repeating)
+      mpi_test::print_failure_rates(rates, pass, list);
+    fflush(stdout);
+
+    if (mpi_test::options.update_baseline)
+      mpi_test::write_baselines(mpi_test::options.baseline_path, baselines);
+
+    if (!mpi_test::options.cache_path.empty())
+      mpi_test::write_cache(mpi_test::options.cache_path, fresh_cache);
+
+    reports.close();
   }
 
   /* now we clean */
 
+  mpi_test::the_watchdog.stop();
+  comms.clear();
+  mpi_test::free_dist_verdict_op();
   MPI_Finalize();
   return 0;
 }
@@ -3,19 +3,38 @@
 
 #include <cmath>
 #include <cstdint>
-#include <iomanip>
+#include <cstring>
 #include <limits>
-#include <sstream>
+#include <ostream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <mpi.h>
 
+// Marks the (rarely taken) failure paths of the assertions.
+#if defined(__GNUC__)
+#define MPI_TEST_COLD __attribute__((noinline, cold))
+#else
+#define MPI_TEST_COLD
+#endif
+
 namespace mpi_test
 {
   // Function pointer type and signature for all tests.
   typedef void (*test_ptr)(MPI_Comm);
 
+  // How (if at all) the runner should compare the timings of the different
+  // sizes a test is registered at. In a strong scaling study the body solves
+  // the same total problem at every size, in a weak scaling study the body
+  // scales the problem with the size of the communicator it's given.
+  enum scaling_mode
+  {
+    scaling_none,
+    scaling_strong,
+    scaling_weak
+  };
+
   // Stores information about a particular assertion known at compile time.
   struct assert_info
   {
@@ -33,15 +52,69 @@ namespace mpi_test
     std::string reason;
   };
 
+  // Where on the machine the ranks of a test should be. A packed test is kept
+  // on as few nodes as possible (so it mostly talks through shared memory), a
+  // spread one puts every rank on a different node (as far as there are
+  // nodes, so it goes through the interconnect) and "both" runs the test once
+  // each way. The default leaves it up to the runner's "--placement".
+  enum placement_mode
+  {
+    placement_default,
+    placement_packed,
+    placement_spread,
+    placement_both
+  };
+
+  // How the runner builds and tears down a suite fixture without knowing its
+  // type, see "TEST_F".
+  struct fixture_info
+  {
+    void* (*create)(MPI_Comm comm);
+    void (*destroy)(void* fixture);
+  };
+
+  template<typename fixture_t>
+  struct suite_fixture
+  {
+    static void* create(MPI_Comm comm)
+    {
+      return new fixture_t(comm);
+    }
+
+    static void destroy(void* fixture)
+    {
+      delete static_cast<fixture_t*>(fixture);
+    }
+
+    static const fixture_info info;
+  };
+
+  template<typename fixture_t>
+  const fixture_info suite_fixture<fixture_t>::info = {&create, &destroy};
+
   // Stores information about a single test.
-  // All test information is populated during dynamic initialization except the
-  // "fails" list which will be populated when a test failure occurs.
+  // All test information is populated during dynamic initialization. Benchmarks
+  // are tests too, they just get run "warmup" times untimed and then
+  // "iterations" times timed (negative values mean use the runner's default).
+  // A negative "timeout" also means use the runner's default. Every
+  // "test_info" lives in static storage created by the "TEST" macro and they're
+  // chained together through "next", so registering a test never allocates.
   struct test_info
   {
     test_ptr fptr;
     int test_size;
     const char* test_name;
-    std::vector<fail_info> fails;
+    bool benchmark;
+    int warmup;
+    int iterations;
+    scaling_mode scaling;
+    double timeout;
+    placement_mode placement;
+    const fixture_info* fixture;
+    int threads;
+    bool calibration;
+    double calibration_bytes;
+    test_info* next;
   };
 
   // Stores the list of tests.
@@ -54,25 +127,323 @@ namespace mpi_test
   // variable, so building the test list is really just a byproduct of dynamic
   // initialization of random variables that don't matter but I guess we have to
   // do things this way in C++...
+  // During dynamic initialization the tests are only linked together (from
+  // "first" to "last"), the driver then builds the "tests" index over them
+  // once, in a single allocation. Only the current test can be failing on any
+  // processor so there's just one list of "fails", which doesn't allocate
+  // anything until something actually fails (the threads of a thread team
+  // each get their own, see "TEST_THREADS"). Same deal for the suite
+  // "fixture" of the current test (if it has one).
   struct test_list
   {
     int current_test;
-    std::vector<test_info> tests;
+    test_info* first;
+    test_info* last;
+    int num_registered;
+    std::vector<test_info*> tests;
+    std::vector<fail_info> fails;
+    void* fixture;
 
     static test_list* instance();
   };
 
-  // Adds "test_info" to the single (per processor) "test_list" during dynamic
-  // initialization. This function is invoked by the "TEST" macro.
-  test_ptr add_test(test_ptr test,
-                    std::initializer_list<int> test_sizes,
-                    const char* name);
+  // Appends a (statically allocated) "test_info" to the single (per processor)
+  // "test_list" during dynamic initialization.
+  void link_test(test_info* info);
+
+  // Build the "test_info" that gets copied for every size a test is registered
+  // at, these are invoked by the "TEST" and "BENCHMARK" macros.
+  test_info test_proto(test_ptr test,
+                       const char* name,
+                       scaling_mode scaling     = scaling_none,
+                       double timeout           = -1.,
+                       placement_mode placement = placement_default);
+
+  test_info benchmark_proto(test_ptr test,
+                            const char* name,
+                            int warmup,
+                            int iterations,
+                            scaling_mode scaling     = scaling_none,
+                            placement_mode placement = placement_default);
+
+  test_info fixture_proto(test_ptr test,
+                          const char* name,
+                          const fixture_info* fixture);
+
+  test_info benchmark_fixture_proto(test_ptr test,
+                                    const char* name,
+                                    const fixture_info* fixture);
+
+  test_info thread_proto(test_ptr test, const char* name, int threads);
+
+  test_info calibration_proto(test_ptr test,
+                              const char* name,
+                              scaling_mode scaling,
+                              placement_mode placement,
+                              double bytes);
+
+  // Defined next to the built in calibration suite, the runner calls it just
+  // so that suite is always linked in.
+  void link_calibration();
+
+  // Registering a test at this size registers it at every power of two from
+  // 2 up to the size of MPI_COMM_WORLD and at that size itself (whatever the
+  // job is launched with), e.g. 2, 4, 8 and 12 on 12 procs.
+  const int world_sizes = -1;
+
+  // Static storage for every size of one registered test, this is the "random
+  // unused variable" the "TEST" macro defines.
+  template<int num_sizes>
+  struct test_registration
+  {
+    test_info infos[num_sizes];
+
+    test_registration(const test_info& proto, const int (&sizes)[num_sizes])
+    {
+      for (int si = 0; si < num_sizes; ++si)
+      {
+        infos[si]           = proto;
+        infos[si].test_size = sizes[si];
+        link_test(&infos[si]);
+      }
+    }
+  };
 
   // The error registration process is always the same, just some compile time
   // information abou the assertion and an exit reason, and the templates need
   // this declared here so ya.
   void register_error(const assert_info assertion, std::string reason);
 
+  // The result of a distributed array comparison, reduced over all processors
+  // of the communicator the comparison ran on. The "worst" element is the one
+  // furthest from its reference value in ULPs (ties go to the lowest global
+  // index).
+  struct dist_verdict
+  {
+    unsigned long long num_elements;
+    unsigned long long num_mismatches;
+    unsigned long long worst_ulp;
+    unsigned long long worst_index;
+  };
+
+  // Collective truth checks over every processor of "comm". Each processor
+  // contributes one boolean to a single MPI_Allreduce and they all return the
+  // same result, so the ASSERT_ versions can't leave some processors behind in
+  // a collective. For "assert_all" only the processors where the statement
+  // was false register a failure, for "assert_any" it's just rank 0 of
+  // "comm".
+  bool assert_all(bool statement, MPI_Comm comm, const assert_info assertion);
+  bool assert_any(bool statement, MPI_Comm comm, const assert_info assertion);
+
+  // Reduces "verdict" over "comm" in place with a single MPI_Allreduce, the
+  // datatype and reduction operation this needs live inside the library.
+  void reduce_dist_verdict(dist_verdict& verdict, MPI_Comm comm);
+
+  /* allocation tracking */
+
+  // The optional allocation layer (lib/libmpitest_alloc.a, linked after
+  // libmpitest) replaces the global operator new and delete to keep count of
+  // the heap usage of each processor (across all of its threads). The number
+  // of allocations and bytes only ever go up, "live_bytes" is whatever is
+  // allocated right now and "peak_bytes" the most that has been live at once
+  // since the last "reset_peak_bytes()". Without the layer it's all zeros.
+  struct alloc_stats
+  {
+    unsigned long long num_allocations;
+    unsigned long long num_bytes;
+    unsigned long long live_bytes;
+    unsigned long long peak_bytes;
+  };
+
+  alloc_stats current_alloc_stats();
+  void reset_peak_bytes();
+
+  // Checks at most "max_allocations" allocations happened since the count
+  // was "start", this always fails without the allocation layer.
+  bool assert_max_allocations(unsigned long long start,
+                              unsigned long long max_allocations,
+                              const assert_info assertion);
+
+  // Hooks for the allocation layer itself, "count_allocation" returns whether
+  // the block got counted (and so has to be uncounted when it's freed).
+  void link_alloc_tracking();
+  bool count_allocation(size_t size);
+  void count_free(size_t size);
+
+  /* communication profiling */
+
+  // The optional PMPI layer (lib/libmpitest_pmpi.a, linked after libmpitest)
+  // counts the point to point messages each processor sends, their bytes and
+  // the collectives it calls, but only while a test body is running. The
+  // library's own communication (the collective assertions included) goes
+  // straight to PMPI so it never ends up in the counts.
+  struct comm_stats
+  {
+    unsigned long long num_messages;
+    unsigned long long num_bytes;
+    unsigned long long num_collectives;
+  };
+
+  comm_stats current_comm_stats();
+
+  // Checks at most "max_messages" messages (or "max_bytes" bytes) were sent
+  // since the count was "start", these always fail without the PMPI layer.
+  bool assert_max_messages(unsigned long long start,
+                           unsigned long long max_messages,
+                           const assert_info assertion);
+  bool assert_max_bytes(unsigned long long start,
+                        unsigned long long max_bytes,
+                        const assert_info assertion);
+
+  // Hooks for the PMPI layer itself.
+  void link_comm_profiling();
+  void count_message(int count, MPI_Datatype type);
+  void count_collective();
+
+  /* failure formatting */
+
+  // Everything below only runs once an assertion has already failed, the
+  // assertions themselves never touch a stream or allocate anything when they
+  // pass. None of the actual formatting lives in this header, it's all
+  // compiled once into the library. The only thing that depends on the type
+  // being compared is writing a single value, which is what the
+  // "value_writer"s are for. The writers for the usual types are instantiated
+  // in the library too (see the "extern template"s below), anything else
+  // just needs an operator<< for it wherever it gets compared.
+
+  // Writes the value "value" points to (a "T") to "out".
+  typedef void (*value_writer)(std::ostream& out, const void* value);
+
+  template<typename T>
+  struct value_writer_of
+  {
+    static void write(std::ostream& out, const void* value)
+    {
+      out << *static_cast<const T*>(value);
+    }
+  };
+
+  // Pointers are all written as plain addresses (whatever they point to), by
+  // a single writer in the library.
+  void write_pointer(std::ostream& out, const void* value);
+
+  template<typename T>
+  struct value_writer_of<T*>
+  {
+    static void write(std::ostream& out, const void* value)
+    {
+      write_pointer(out, *static_cast<T* const*>(value));
+    }
+  };
+
+  extern template struct value_writer_of<bool>;
+  extern template struct value_writer_of<char>;
+  extern template struct value_writer_of<int>;
+  extern template struct value_writer_of<unsigned int>;
+  extern template struct value_writer_of<long>;
+  extern template struct value_writer_of<unsigned long>;
+  extern template struct value_writer_of<long long>;
+  extern template struct value_writer_of<unsigned long long>;
+  extern template struct value_writer_of<float>;
+  extern template struct value_writer_of<double>;
+
+  // The type erased failure paths, "a" and "b" point to the values (or arrays
+  // of "element_size" byte values) that were compared. For the arrays
+  // "listed" holds the indices of the first "num_listed" mismatches.
+  MPI_TEST_COLD void fail_true_value(const assert_info assertion,
+                                     const void* statement,
+                                     value_writer write);
+
+  MPI_TEST_COLD void fail_eq_values(const assert_info assertion,
+                                    const void* a,
+                                    const void* b,
+                                    value_writer write);
+
+  MPI_TEST_COLD void fail_array_values(const assert_info assertion,
+                                       const void* a,
+                                       const void* b,
+                                       size_t element_size,
+                                       size_t n,
+                                       size_t num_mismatches,
+                                       const size_t* listed,
+                                       int num_listed,
+                                       value_writer write);
+
+  // The IEEE 754 failures are only ever instantiated for <float, uint32_t>
+  // and <double, uint64_t>, both of which live in the library.
+  template<typename fxx, typename uxx>
+  MPI_TEST_COLD void fail_ieee754(const assert_info assertion,
+                                  fxx a,
+                                  fxx b,
+                                  int ulp_tol,
+                                  fxx abs_tol);
+
+  template<typename fxx, typename uxx>
+  MPI_TEST_COLD void fail_ieee754_array(const assert_info assertion,
+                                        const fxx* a,
+                                        const fxx* b,
+                                        size_t n,
+                                        size_t num_mismatches,
+                                        int ulp_tol,
+                                        fxx abs_tol);
+
+  extern template void fail_ieee754<float, uint32_t>(
+  const assert_info, float, float, int, float);
+  extern template void fail_ieee754<double, uint64_t>(
+  const assert_info, double, double, int, double);
+  extern template void fail_ieee754_array<float, uint32_t>(
+  const assert_info, const float*, const float*, size_t, size_t, int, float);
+  extern template void fail_ieee754_array<double, uint64_t>(const assert_info,
+                                                            const double*,
+                                                            const double*,
+                                                            size_t,
+                                                            size_t,
+                                                            int,
+                                                            double);
+
+  template<typename T>
+  MPI_TEST_COLD void fail_true(T statement, const assert_info assertion)
+  {
+    fail_true_value(assertion, &statement, &value_writer_of<T>::write);
+  }
+
+  template<typename T>
+  MPI_TEST_COLD void fail_eq(T a, T b, const assert_info assertion)
+  {
+    fail_eq_values(assertion, &a, &b, &value_writer_of<T>::write);
+  }
+
+  // The array assertions only register a single failure per array no matter
+  // how many elements are off, the first few mismatches are listed and the
+  // rest are only counted.
+  const int max_listed_mismatches = 10;
+
+  template<typename T>
+  MPI_TEST_COLD void fail_array_eq(const T* a,
+                                   const T* b,
+                                   size_t n,
+                                   size_t num_mismatches,
+                                   const assert_info assertion)
+  {
+    size_t listed[max_listed_mismatches];
+    int num_listed = 0;
+    for (size_t i = 0; i < n && num_listed < max_listed_mismatches; ++i)
+    {
+      if (a[i] != b[i])
+        listed[num_listed++] = i;
+    }
+
+    fail_array_values(assertion,
+                      a,
+                      b,
+                      sizeof(T),
+                      n,
+                      num_mismatches,
+                      listed,
+                      num_listed,
+                      &value_writer_of<T>::write);
+  }
+
   /* template assertion implementations */
 
   // Tests if the given statement is truthy.
@@ -82,9 +453,7 @@ namespace mpi_test
     if (statement)
       return true;
 
-    std::stringstream reason;
-    reason << statement << " is falsy";
-    register_error(assertion, reason.str());
+    fail_true(statement, assertion);
     return false;
   }
 
@@ -96,9 +465,7 @@ namespace mpi_test
     if (a == b)
       return true;
 
-    std::stringstream reason;
-    reason << a << " does not equal " << b;
-    register_error(assertion, reason.str());
+    fail_eq(a, b, assertion);
     return false;
   }
 
@@ -118,62 +485,22 @@ namespace mpi_test
                          int ulp_tol,
                          fxx abs_tol = std::numeric_limits<fxx>::epsilon())
   {
-    std::stringstream reason;
-
     /* quick out if the input is garbage */
 
-    bool quick_exit = false;
-
-    if (std::isnan(a))
-    {
-      reason << "the first argument is nan! ";
-      quick_exit = true;
-    }
-    else if (std::isinf(a))
-    {
-      reason << "the first argument is inf! ";
-      quick_exit = true;
-    }
-
-    if (std::isnan(b))
-    {
-      reason << "the second argument is nan! ";
-      quick_exit = true;
-    }
-    else if (std::isinf(b))
-    {
-      reason << "the second argument is inf! ";
-      quick_exit = true;
-    }
-
-    if (quick_exit)
+    if (!std::isfinite(a) || !std::isfinite(b))
     {
-      register_error(assertion, reason.str());
+      fail_ieee754<fxx, uxx>(assertion, a, b, ulp_tol, abs_tol);
       return false;
     }
 
-    // reinterpret to unsigned integers
-
-    uxx au = *reinterpret_cast<uxx*>(&a);
-    uxx bu = *reinterpret_cast<uxx*>(&b);
-
     /* absolute comparison */
 
     if ((std::signbit(a) != std::signbit(b)) ||
         (fabs(a) < abs_tol && fabs(b) < abs_tol))
     {
-      fxx diff, tol;
-      if ((diff = fabs(a - b)) > (tol = abs_tol))
+      if (fabs(a - b) > abs_tol)
       {
-        reason << "absolute difference between "
-               << std::setprecision(std::numeric_limits<fxx>::digits10 + 1) << a
-               << " and "
-               << std::setprecision(std::numeric_limits<fxx>::digits10 + 1) << b
-               << " ("
-               << std::setprecision(std::numeric_limits<fxx>::digits10 + 1)
-               << diff << ")"
-               << " is outside the requested tolerance " << abs_tol;
-        register_error(assertion, reason.str());
+        fail_ieee754<fxx, uxx>(assertion, a, b, ulp_tol, abs_tol);
         return false;
       }
       return true;
@@ -181,46 +508,403 @@ namespace mpi_test
 
     /* ulp comparison */
 
-    if (au > bu)
+    // reinterpret to unsigned integers
+    uxx au, bu;
+    memcpy(&au, &a, sizeof(fxx));
+    memcpy(&bu, &b, sizeof(fxx));
+
+    if (((au > bu) ? au - bu : bu - au) > ulp_tol)
     {
-      if (au - bu > ulp_tol)
-      {
-        reason << std::setprecision(std::numeric_limits<fxx>::digits10 + 1) << a
-               << " and "
-               << std::setprecision(std::numeric_limits<fxx>::digits10 + 1) << b
-               << " differ by " << au - bu
-               << " ULPs, the requested tolerance is " << ulp_tol << " ULPs";
-        register_error(assertion, reason.str());
-        return false;
-      }
+      fail_ieee754<fxx, uxx>(assertion, a, b, ulp_tol, abs_tol);
+      return false;
     }
-    else if (bu > au)
+
+    return true;
+  }
+
+  /* array assertions */
+
+  // The array assertions make a single pass over the data that only counts
+  // mismatches, the per element checks are written without any branches so
+  // the loop vectorizes (build with optimization and your target's -march to
+  // get AVX2/AVX-512 code). The arrays are only walked a second time if
+  // something actually failed.
+
+  // Compares two arrays of "n" elements with operator==().
+  template<typename T>
+  bool assert_array_eq(const T* a,
+                       const T* b,
+                       size_t n,
+                       const assert_info assertion)
+  {
+    size_t num_mismatches = 0;
+    for (size_t i = 0; i < n; ++i)
+      num_mismatches += (a[i] != b[i]);
+
+    if (num_mismatches == 0)
+      return true;
+
+    fail_array_eq(a, b, n, num_mismatches, assertion);
+    return false;
+  }
+
+  // Branch free version of the comparison in "assert_ieee754_eq", true if "a"
+  // and "b" do NOT compare equal. Note the bitwise (not logical) operators,
+  // they keep the compiler from introducing branches.
+  template<typename fxx, typename uxx>
+  inline bool ieee754_mismatch(fxx a, fxx b, int ulp_tol, fxx abs_tol)
+  {
+    const uxx sign_mask = (uxx)1 << (8 * sizeof(uxx) - 1);
+
+    // all exponent bits set means inf or nan
+    const fxx inf = std::numeric_limits<fxx>::infinity();
+    uxx expo_mask;
+    memcpy(&expo_mask, &inf, sizeof(fxx));
+
+    uxx au, bu;
+    memcpy(&au, &a, sizeof(fxx));
+    memcpy(&bu, &b, sizeof(fxx));
+
+    bool garbage = ((au & expo_mask) == expo_mask) |
+                   ((bu & expo_mask) == expo_mask);
+
+    bool use_abs  = (((au ^ bu) & sign_mask) != 0) |
+                    ((fabs(a) < abs_tol) & (fabs(b) < abs_tol));
+    bool abs_fail = fabs(a - b) > abs_tol;
+    uxx ulp_diff  = (au > bu) ? au - bu : bu - au;
+    bool ulp_fail = ulp_diff > (uxx)ulp_tol;
+
+    return garbage | (use_abs ? abs_fail : ulp_fail);
+  }
+
+  // Array version of "assert_ieee754_eq", element "i" of "a" is compared with
+  // element "i" of "b" using exactly the same rules.
+  template<typename fxx, typename uxx>
+  bool assert_ieee754_array_eq(
+  const assert_info assertion,
+  const fxx* a,
+  const fxx* b,
+  size_t n,
+  int ulp_tol,
+  fxx abs_tol = std::numeric_limits<fxx>::epsilon())
+  {
+    size_t num_mismatches = 0;
+    for (size_t i = 0; i < n; ++i)
+      num_mismatches +=
+      ieee754_mismatch<fxx, uxx>(a[i], b[i], ulp_tol, abs_tol);
+
+    if (num_mismatches == 0)
+      return true;
+
+    fail_ieee754_array<fxx, uxx>(
+    assertion, a, b, n, num_mismatches, ulp_tol, abs_tol);
+    return false;
+  }
+
+  /* distributed array assertions */
+
+  // These compare a distributed array against a reference without moving any
+  // element data. Each processor checks its own slice and the only
+  // communication is one MPI_Allreduce of a "dist_verdict", so every processor
+  // comes out agreeing on the result. That makes the ASSERT_ versions safe to
+  // use ahead of other collectives. The reference is either a pointer to the
+  // expected local slice or anything callable with a global element index
+  // that returns the expected value.
+
+  // Maps a floating point type to the unsigned integer type of the same size.
+  template<typename fxx>
+  struct ieee754_traits;
+
+  template<>
+  struct ieee754_traits<float>
+  {
+    typedef float real;
+    typedef uint32_t bits;
+  };
+
+  template<>
+  struct ieee754_traits<double>
+  {
+    typedef double real;
+    typedef uint64_t bits;
+  };
+
+  // The distance in ULPs between "a" and "b" counted straight through zero,
+  // anything involving nan or inf is as far away as it gets. The bit patterns
+  // are mapped so that unsigned integer order matches floating point order.
+  template<typename fxx, typename uxx>
+  inline unsigned long long ieee754_distance(fxx a, fxx b)
+  {
+    if (!std::isfinite(a) || !std::isfinite(b))
+      return std::numeric_limits<unsigned long long>::max();
+
+    const uxx sign_mask = (uxx)1 << (8 * sizeof(uxx) - 1);
+
+    uxx au, bu;
+    memcpy(&au, &a, sizeof(fxx));
+    memcpy(&bu, &b, sizeof(fxx));
+    au = (au & sign_mask) ? ~au : (au | sign_mask);
+    bu = (bu & sign_mask) ? ~bu : (bu | sign_mask);
+
+    return (au > bu) ? au - bu : bu - au;
+  }
+
+  template<typename fxx, typename ref_t>
+  inline fxx dist_reference(ref_t ref,
+                            unsigned long long global_index,
+                            size_t local_index,
+                            std::true_type /* ref is a pointer */)
+  {
+    return ref[local_index];
+  }
+
+  template<typename fxx, typename ref_t>
+  inline fxx dist_reference(ref_t ref,
+                            unsigned long long global_index,
+                            size_t local_index,
+                            std::false_type /* ref is callable */)
+  {
+    return ref(global_index);
+  }
+
+  MPI_TEST_COLD void fail_dist_array(const assert_info assertion,
+                                     const dist_verdict& verdict,
+                                     int comm_size,
+                                     int ulp_tol);
+
+  // Compares the local slice "local" (of "n_local" elements) against "ref" on
+  // every processor of "comm" using the same rules as "assert_ieee754_eq".
+  // Global indices follow rank order. This is collective over "comm" and
+  // returns the same value on every processor, the failure is only registered
+  // (once) on rank 0 of "comm".
+  template<typename fxx, typename ref_t>
+  bool assert_dist_array_eq(
+  const assert_info assertion,
+  MPI_Comm comm,
+  const fxx* local,
+  size_t n_local,
+  ref_t ref,
+  int ulp_tol,
+  typename ieee754_traits<fxx>::real abs_tol =
+  std::numeric_limits<fxx>::epsilon())
+  {
+    typedef typename ieee754_traits<fxx>::bits uxx;
+    typedef std::integral_constant<bool, std::is_pointer<ref_t>::value> kind;
+
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+
+    unsigned long long n = n_local, offset = 0;
+    PMPI_Exscan(&n, &offset, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    if (rank == 0)
+      offset = 0;
+
+    dist_verdict verdict = {n, 0, 0, offset};
+    for (size_t i = 0; i < n_local; ++i)
     {
-      if (bu - au > ulp_tol)
+      fxx expected  = dist_reference<fxx>(ref, offset + i, i, kind());
+      bool mismatch =
+      ieee754_mismatch<fxx, uxx>(local[i], expected, ulp_tol, abs_tol);
+      verdict.num_mismatches += mismatch;
+
+      // The worst element is the worst one that doesn't compare equal, the
+      // passing ones only count as long as nothing has failed (an element
+      // near zero can be a huge number of ULPs off and still pass).
+      if (!mismatch && verdict.num_mismatches > 0)
+        continue;
+      unsigned long long ulp = ieee754_distance<fxx, uxx>(local[i], expected);
+      if ((mismatch && verdict.num_mismatches == 1) || ulp > verdict.worst_ulp)
       {
-        reason << std::setprecision(std::numeric_limits<fxx>::digits10 + 1) << a
-               << " and "
-               << std::setprecision(std::numeric_limits<fxx>::digits10 + 1) << b
-               << " differ by " << bu - au
-               << " ULPs, the requested tolerance is " << ulp_tol << " ULPs";
-        register_error(assertion, reason.str());
-        return false;
+        verdict.worst_ulp   = ulp;
+        verdict.worst_index = offset + i;
       }
     }
 
-    return true;
+    reduce_dist_verdict(verdict, comm);
+
+    if (verdict.num_mismatches == 0)
+      return true;
+
+    if (rank == 0)
+      fail_dist_array(assertion, verdict, size, ulp_tol);
+    return false;
   }
 
 }  // namespace mpi_test
 
 /* test definition macro */
 
-#define TEST(name, ...)                              \
-  void name(MPI_Comm comm);                          \
-  mpi_test::test_ptr test_##name =                   \
-  mpi_test::add_test(&(name), {__VA_ARGS__}, #name); \
+// All of the definition macros below go through this one. The sizes go into a
+// static array so the registration knows how many "test_info"s it needs at
+// compile time.
+#define MPI_TEST_REGISTER(name, proto, ...)                    \
+  void name(MPI_Comm comm);                                    \
+  static const int name##_test_sizes[] = {__VA_ARGS__};        \
+  static mpi_test::test_registration<sizeof(name##_test_sizes) \
+                                     / sizeof(int)>            \
+  test_##name((proto), name##_test_sizes);                     \
   void name(MPI_Comm comm)
 
+#define TEST(name, ...) \
+  MPI_TEST_REGISTER(name, mpi_test::test_proto(&(name), #name), __VA_ARGS__)
+
+// Same as TEST but with its own timeout in seconds (zero for none) in place of
+// the runner's default.
+
+#define TEST_TIMEOUT(name, timeout, ...)                                    \
+  MPI_TEST_REGISTER(                                                        \
+  name,                                                                     \
+  mpi_test::test_proto(&(name), #name, mpi_test::scaling_none, (timeout)), \
+  __VA_ARGS__)
+
+// Same as TEST but with its own placement (a "mpi_test::placement_mode") in
+// place of the runner's default.
+
+#define TEST_PLACEMENT(name, placement, ...)                                \
+  MPI_TEST_REGISTER(                                                        \
+  name,                                                                     \
+  mpi_test::test_proto(                                                     \
+  &(name), #name, mpi_test::scaling_none, -1., (placement)),                \
+  __VA_ARGS__)
+
+/* thread teams */
+
+namespace mpi_test
+{
+  // Index of the calling thread in the team running the current test (0 for
+  // the thread that called the test) and the size of that team, 1 outside of
+  // "TEST_THREADS".
+  int team_thread();
+  int team_size();
+
+  // The thread support MPI actually provided (one of MPI_THREAD_SINGLE ...
+  // MPI_THREAD_MULTIPLE), at least what was asked for with --thread-level.
+  int thread_level();
+
+}  // namespace mpi_test
+
+// A test that runs its body on a team of "threads" threads on every
+// processor, all of them sharing "comm". The body gets its own "thread"
+// index (0 is the calling thread) and "num_threads". Assertions work from
+// any of them, every thread collects its own failures and they're merged
+// once the team is done. Calling MPI from more than one thread at once
+// needs --thread-level=multiple (check "mpi_test::thread_level()"), and the
+// collective assertions are collectives, so only one thread per processor
+// should use them.
+
+#define TEST_THREADS(name, threads, ...)                                  \
+  void name##_body(MPI_Comm comm, int thread, int num_threads);           \
+  MPI_TEST_REGISTER(name,                                                 \
+                    mpi_test::thread_proto(&(name), #name, (threads)),    \
+                    __VA_ARGS__)                                          \
+  {                                                                       \
+    name##_body(comm, mpi_test::team_thread(), mpi_test::team_size());    \
+  }                                                                       \
+  void name##_body(MPI_Comm comm, int thread, int num_threads)
+
+/* calibration macro */
+
+// A benchmark that's part of the calibration suite, these only run with
+// --calibrate and then before any other test. "bytes" is how much data one
+// run of the body moves (zero if that doesn't mean anything for it), the
+// runner reports the bandwidth that works out to.
+
+#define CALIBRATION(name, scaling, placement, bytes, ...)                  \
+  MPI_TEST_REGISTER(                                                       \
+  name,                                                                    \
+  mpi_test::calibration_proto(                                             \
+  &(name), #name, (scaling), (placement), (bytes)),                        \
+  __VA_ARGS__)
+
+/* suite fixture macros */
+
+// A test that shares a single instance of "fixture_type" with every other
+// TEST_F (or BENCHMARK_F) using the same fixture type on the same
+// communicator shape (size and ranks). The fixture is built with
+// "fixture_type(comm)" (collective over the shape, before the first test that
+// needs it) and destroyed after the last one is done with it, in between the
+// tests only ever see it as "const fixture_type& fixture".
+
+#define MPI_TEST_FIXTURE_REGISTER(name, fixture_type, proto, ...)         \
+  void name##_body(MPI_Comm comm, const fixture_type& fixture);           \
+  MPI_TEST_REGISTER(                                                      \
+  name,                                                                   \
+  proto(&(name), #name, &mpi_test::suite_fixture<fixture_type>::info),    \
+  __VA_ARGS__)                                                            \
+  {                                                                       \
+    name##_body(comm,                                                     \
+                *static_cast<const fixture_type*>(                        \
+                mpi_test::test_list::instance()->fixture));               \
+  }                                                                       \
+  void name##_body(MPI_Comm comm, const fixture_type& fixture)
+
+#define TEST_F(name, fixture_type, ...) \
+  MPI_TEST_FIXTURE_REGISTER(            \
+  name, fixture_type, mpi_test::fixture_proto, __VA_ARGS__)
+
+// The same for a benchmark (with the runner's default warmup and timed runs),
+// the fixture is built outside of the timing so only the body gets timed.
+
+#define BENCHMARK_F(name, fixture_type, ...) \
+  MPI_TEST_FIXTURE_REGISTER(                 \
+  name, fixture_type, mpi_test::benchmark_fixture_proto, __VA_ARGS__)
+
+/* benchmark definition macros */
+
+// Benchmarks are registered and run just like tests (assertions work in them
+// too) but the body is run a few times untimed and then a number of times
+// timed, with a barrier around each run. Timing statistics across processors
+// are reported with the result. Benchmarks never share the machine with other
+// tests. BENCHMARK_ITERATIONS picks the number of warmup and timed runs
+// explicitly, BENCHMARK uses the runner's defaults.
+
+#define BENCHMARK_ITERATIONS(name, warmup, iterations, ...)                  \
+  MPI_TEST_REGISTER(                                                         \
+  name,                                                                      \
+  mpi_test::benchmark_proto(&(name), #name, (warmup), (iterations)),         \
+  __VA_ARGS__)
+
+#define BENCHMARK(name, ...) BENCHMARK_ITERATIONS(name, -1, -1, __VA_ARGS__)
+
+#define BENCHMARK_PLACEMENT(name, placement, ...)                           \
+  MPI_TEST_REGISTER(                                                        \
+  name,                                                                     \
+  mpi_test::benchmark_proto(                                                \
+  &(name), #name, -1, -1, mpi_test::scaling_none, (placement)),             \
+  __VA_ARGS__)
+
+/* scaling study macros */
+
+// These register a test or benchmark at several sizes just like TEST and
+// BENCHMARK but also ask the runner for a scaling summary once everything has
+// run: the time at each size along with the speedup and parallel efficiency
+// relative to the smallest size. Tests are compared by their wall time,
+// benchmarks by the median time of their slowest processor. For weak scaling
+// it's up to the body to scale its problem with the size of "comm".
+
+#define TEST_SCALING(name, scaling, ...)                              \
+  MPI_TEST_REGISTER(                                                  \
+  name, mpi_test::test_proto(&(name), #name, (scaling)), __VA_ARGS__)
+
+#define TEST_STRONG_SCALING(name, ...) \
+  TEST_SCALING(name, mpi_test::scaling_strong, __VA_ARGS__)
+
+#define TEST_WEAK_SCALING(name, ...) \
+  TEST_SCALING(name, mpi_test::scaling_weak, __VA_ARGS__)
+
+#define BENCHMARK_SCALING(name, scaling, ...)                           \
+  MPI_TEST_REGISTER(                                                    \
+  name,                                                                 \
+  mpi_test::benchmark_proto(&(name), #name, -1, -1, (scaling)),         \
+  __VA_ARGS__)
+
+#define BENCHMARK_STRONG_SCALING(name, ...) \
+  BENCHMARK_SCALING(name, mpi_test::scaling_strong, __VA_ARGS__)
+
+#define BENCHMARK_WEAK_SCALING(name, ...) \
+  BENCHMARK_SCALING(name, mpi_test::scaling_weak, __VA_ARGS__)
+
 /* assertions */
 
 // Checks if the given statement is truthy.
@@ -235,6 +919,33 @@ namespace mpi_test
     return;                                                                \
   }
 
+// Collective versions of EXPECT_TRUE, these must be reached by every processor
+// of "comm". EXPECT_ALL passes if the statement is true on every processor,
+// EXPECT_ANY if it's true on at least one. Either way every processor gets the
+// same answer, so ASSERT_ALL and ASSERT_ANY return on all of them together.
+
+#define EXPECT_ALL(comm, a) \
+  mpi_test::assert_all(     \
+  (a), (comm), {__LINE__, __FILE__, "EXPECT_ALL(" #a ")"})
+
+#define ASSERT_ALL(comm, a)                                       \
+  if (!mpi_test::assert_all(                                      \
+      (a), (comm), {__LINE__, __FILE__, "ASSERT_ALL(" #a ")"}))   \
+  {                                                               \
+    return;                                                       \
+  }
+
+#define EXPECT_ANY(comm, a) \
+  mpi_test::assert_any(     \
+  (a), (comm), {__LINE__, __FILE__, "EXPECT_ANY(" #a ")"})
+
+#define ASSERT_ANY(comm, a)                                       \
+  if (!mpi_test::assert_any(                                      \
+      (a), (comm), {__LINE__, __FILE__, "ASSERT_ANY(" #a ")"}))   \
+  {                                                               \
+    return;                                                       \
+  }
+
 // Compares two objects with operator==(). They'll also need to support
 // operator<<() for error printing but this is only really intended for
 // primitives anyway.
@@ -290,4 +1001,190 @@ namespace mpi_test
     return;                                                     \
   }
 
+// Array versions of the comparisons above, "a" and "b" are pointers to "n"
+// elements each. A failing array assertion is reported once with the total
+// number of mismatching elements and the first few mismatches listed.
+
+#define EXPECT_ARRAY_EQ(a, b, n)       \
+  mpi_test::assert_array_eq((a),       \
+                            (b),       \
+                            (n),       \
+                            {__LINE__, \
+                             __FILE__, \
+                             "EXPECT_ARRAY_EQ(" #a ", " #b ", " #n ")"})
+
+#define ASSERT_ARRAY_EQ(a, b, n)                                       \
+  if (!mpi_test::assert_array_eq(                                      \
+      (a),                                                             \
+      (b),                                                             \
+      (n),                                                             \
+      {__LINE__, __FILE__, "ASSERT_ARRAY_EQ(" #a ", " #b ", " #n ")"})) \
+  {                                                                    \
+    return;                                                            \
+  }
+
+// The variadic arguments are the same as for EXPECT_FLOAT_EQ and friends, the
+// ULP tolerance and then optionally the absolute tolerance.
+
+#define EXPECT_FLOAT_ARRAY_EQ(a, b, n, ...)                                  \
+  mpi_test::assert_ieee754_array_eq<float, uint32_t>(                        \
+  {__LINE__, __FILE__, "EXPECT_FLOAT_ARRAY_EQ(" #a ", " #b ", " #n ")"},     \
+  (a),                                                                       \
+  (b),                                                                       \
+  (n),                                                                       \
+  __VA_ARGS__)
+
+#define ASSERT_FLOAT_ARRAY_EQ(a, b, n, ...)                                  \
+  if (!mpi_test::assert_ieee754_array_eq<float, uint32_t>(                   \
+      {__LINE__, __FILE__, "ASSERT_FLOAT_ARRAY_EQ(" #a ", " #b ", " #n ")"}, \
+      (a),                                                                   \
+      (b),                                                                   \
+      (n),                                                                   \
+      __VA_ARGS__))                                                          \
+  {                                                                          \
+    return;                                                                  \
+  }
+
+#define EXPECT_DOUBLE_ARRAY_EQ(a, b, n, ...)                                  \
+  mpi_test::assert_ieee754_array_eq<double, uint64_t>(                        \
+  {__LINE__, __FILE__, "EXPECT_DOUBLE_ARRAY_EQ(" #a ", " #b ", " #n ")"},     \
+  (a),                                                                        \
+  (b),                                                                        \
+  (n),                                                                        \
+  __VA_ARGS__)
+
+#define ASSERT_DOUBLE_ARRAY_EQ(a, b, n, ...)                                  \
+  if (!mpi_test::assert_ieee754_array_eq<double, uint64_t>(                   \
+      {__LINE__, __FILE__, "ASSERT_DOUBLE_ARRAY_EQ(" #a ", " #b ", " #n ")"}, \
+      (a),                                                                    \
+      (b),                                                                    \
+      (n),                                                                    \
+      __VA_ARGS__))                                                           \
+  {                                                                           \
+    return;                                                                   \
+  }
+
+// Distributed array comparisons, these are collective over "comm". The first
+// variadic argument is the ULP tolerance and the second (optional) one the
+// absolute tolerance, just like EXPECT_FLOAT_EQ. "ref" is either a pointer to
+// the expected local slice or a callable taking a global element index. Since
+// every processor agrees on the result ASSERT_DIST_ARRAY_EQ returns on all of
+// them together.
+
+#define EXPECT_DIST_ARRAY_EQ(comm, local, n_local, ref, ...)               \
+  mpi_test::assert_dist_array_eq({__LINE__,                                \
+                                  __FILE__,                                \
+                                  "EXPECT_DIST_ARRAY_EQ(" #local ", " #ref \
+                                  ")"},                                    \
+                                 (comm),                                   \
+                                 (local),                                  \
+                                 (n_local),                                \
+                                 (ref),                                    \
+                                 __VA_ARGS__)
+
+#define ASSERT_DIST_ARRAY_EQ(comm, local, n_local, ref, ...)                  \
+  if (!mpi_test::assert_dist_array_eq(                                        \
+      {__LINE__, __FILE__, "ASSERT_DIST_ARRAY_EQ(" #local ", " #ref ")"},     \
+      (comm),                                                                 \
+      (local),                                                                \
+      (n_local),                                                              \
+      (ref),                                                                  \
+      __VA_ARGS__))                                                           \
+  {                                                                           \
+    return;                                                                   \
+  }
+
+// Runs the statement(s) and checks this processor made at most "n" heap
+// allocations while doing so, for hot paths that shouldn't be allocating.
+// Allocations on other threads of the processor count too.
+
+#define EXPECT_MAX_ALLOCATIONS(n, ...)                                     \
+  do                                                                       \
+  {                                                                        \
+    unsigned long long mpi_test_start =                                    \
+    mpi_test::current_alloc_stats().num_allocations;                       \
+    __VA_ARGS__;                                                           \
+    mpi_test::assert_max_allocations(                                      \
+    mpi_test_start,                                                        \
+    (n),                                                                   \
+    {__LINE__, __FILE__, "EXPECT_MAX_ALLOCATIONS(" #n ", " #__VA_ARGS__ ")"}); \
+  } while (0)
+
+#define ASSERT_MAX_ALLOCATIONS(n, ...)                                     \
+  do                                                                       \
+  {                                                                        \
+    unsigned long long mpi_test_start =                                    \
+    mpi_test::current_alloc_stats().num_allocations;                       \
+    __VA_ARGS__;                                                           \
+    if (!mpi_test::assert_max_allocations(                                 \
+        mpi_test_start,                                                    \
+        (n),                                                               \
+        {__LINE__,                                                         \
+         __FILE__,                                                         \
+         "ASSERT_MAX_ALLOCATIONS(" #n ", " #__VA_ARGS__ ")"}))             \
+    {                                                                      \
+      return;                                                              \
+    }                                                                      \
+  } while (0)
+
+// Same idea for communication, the statement(s) may send at most "n"
+// messages (or "n" bytes in messages) from this processor. Collectives don't
+// count as messages. These need the PMPI layer linked in.
+
+#define EXPECT_MAX_MESSAGES(n, ...)                                       \
+  do                                                                      \
+  {                                                                       \
+    unsigned long long mpi_test_start =                                   \
+    mpi_test::current_comm_stats().num_messages;                          \
+    __VA_ARGS__;                                                          \
+    mpi_test::assert_max_messages(                                        \
+    mpi_test_start,                                                       \
+    (n),                                                                  \
+    {__LINE__, __FILE__, "EXPECT_MAX_MESSAGES(" #n ", " #__VA_ARGS__ ")"}); \
+  } while (0)
+
+#define ASSERT_MAX_MESSAGES(n, ...)                                   \
+  do                                                                  \
+  {                                                                   \
+    unsigned long long mpi_test_start =                               \
+    mpi_test::current_comm_stats().num_messages;                      \
+    __VA_ARGS__;                                                      \
+    if (!mpi_test::assert_max_messages(                               \
+        mpi_test_start,                                               \
+        (n),                                                          \
+        {__LINE__,                                                    \
+         __FILE__,                                                    \
+         "ASSERT_MAX_MESSAGES(" #n ", " #__VA_ARGS__ ")"}))           \
+    {                                                                 \
+      return;                                                         \
+    }                                                                 \
+  } while (0)
+
+#define EXPECT_MAX_BYTES(n, ...)                                       \
+  do                                                                   \
+  {                                                                    \
+    unsigned long long mpi_test_start =                                \
+    mpi_test::current_comm_stats().num_bytes;                          \
+    __VA_ARGS__;                                                       \
+    mpi_test::assert_max_bytes(                                        \
+    mpi_test_start,                                                    \
+    (n),                                                               \
+    {__LINE__, __FILE__, "EXPECT_MAX_BYTES(" #n ", " #__VA_ARGS__ ")"}); \
+  } while (0)
+
+#define ASSERT_MAX_BYTES(n, ...)                                      \
+  do                                                                  \
+  {                                                                   \
+    unsigned long long mpi_test_start =                               \
+    mpi_test::current_comm_stats().num_bytes;                         \
+    __VA_ARGS__;                                                      \
+    if (!mpi_test::assert_max_bytes(                                  \
+        mpi_test_start,                                               \
+        (n),                                                          \
+        {__LINE__, __FILE__, "ASSERT_MAX_BYTES(" #n ", " #__VA_ARGS__ ")"})) \
+    {                                                                 \
+      return;                                                         \
+    }                                                                 \
+  } while (0)
+
 #endif
@@ -0,0 +1,610 @@
+#include <mpi.h>
+
+#include "mpitest.h"
+
+// The PMPI interposition layer, this lives in its own library
+// (lib/libmpitest_pmpi.a) since not everybody wants every MPI call to go
+// through it. Link it after libmpitest, libmpitest refers to MPI_Barrier and
+// friends so the linker pulls all of this in and the runner starts reporting
+// the communication of every test. Each wrapper just counts and then hands
+// off to the real thing through PMPI, the counting itself only happens while
+// a test body is running (see "count_message" in mpitest.cpp).
+// Point to point messages are counted once on the sending side, collectives
+// are counted as one call on every (calling) processor. Every blocking call
+// below comes with its nonblocking version, counted when it's started.
+// Not counted at all: persistent requests (MPI_Send_init and friends, and
+// whatever MPI_Start starts), the neighborhood collectives, the "w" and
+// "_block" variants of the collectives and one sided communication
+// (MPI_Put, MPI_Get, MPI_Accumulate, ...). Tests that use those report too
+// few messages and collectives, and the message and byte limits can't catch
+// anything in them.
+
+namespace
+{
+  // Lets the runner know it's been linked in during dynamic initialization,
+  // just like the "TEST" macro registering tests.
+  struct pmpi_layer
+  {
+    pmpi_layer()
+    {
+      mpi_test::link_comm_profiling();
+    }
+  };
+
+  pmpi_layer the_pmpi_layer;
+
+}  // namespace
+
+/* point to point */
+
+int MPI_Send(const void* buf,
+             int count,
+             MPI_Datatype datatype,
+             int dest,
+             int tag,
+             MPI_Comm comm)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Send(buf, count, datatype, dest, tag, comm);
+}
+
+int MPI_Ssend(const void* buf,
+              int count,
+              MPI_Datatype datatype,
+              int dest,
+              int tag,
+              MPI_Comm comm)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Ssend(buf, count, datatype, dest, tag, comm);
+}
+
+int MPI_Bsend(const void* buf,
+              int count,
+              MPI_Datatype datatype,
+              int dest,
+              int tag,
+              MPI_Comm comm)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Bsend(buf, count, datatype, dest, tag, comm);
+}
+
+int MPI_Rsend(const void* buf,
+              int count,
+              MPI_Datatype datatype,
+              int dest,
+              int tag,
+              MPI_Comm comm)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Rsend(buf, count, datatype, dest, tag, comm);
+}
+
+int MPI_Isend(const void* buf,
+              int count,
+              MPI_Datatype datatype,
+              int dest,
+              int tag,
+              MPI_Comm comm,
+              MPI_Request* request)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Isend(buf, count, datatype, dest, tag, comm, request);
+}
+
+int MPI_Issend(const void* buf,
+               int count,
+               MPI_Datatype datatype,
+               int dest,
+               int tag,
+               MPI_Comm comm,
+               MPI_Request* request)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Issend(buf, count, datatype, dest, tag, comm, request);
+}
+
+int MPI_Ibsend(const void* buf,
+               int count,
+               MPI_Datatype datatype,
+               int dest,
+               int tag,
+               MPI_Comm comm,
+               MPI_Request* request)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Ibsend(buf, count, datatype, dest, tag, comm, request);
+}
+
+int MPI_Irsend(const void* buf,
+               int count,
+               MPI_Datatype datatype,
+               int dest,
+               int tag,
+               MPI_Comm comm,
+               MPI_Request* request)
+{
+  mpi_test::count_message(count, datatype);
+  return PMPI_Irsend(buf, count, datatype, dest, tag, comm, request);
+}
+
+int MPI_Sendrecv(const void* sendbuf,
+                 int sendcount,
+                 MPI_Datatype sendtype,
+                 int dest,
+                 int sendtag,
+                 void* recvbuf,
+                 int recvcount,
+                 MPI_Datatype recvtype,
+                 int source,
+                 int recvtag,
+                 MPI_Comm comm,
+                 MPI_Status* status)
+{
+  mpi_test::count_message(sendcount, sendtype);
+  return PMPI_Sendrecv(sendbuf,
+                       sendcount,
+                       sendtype,
+                       dest,
+                       sendtag,
+                       recvbuf,
+                       recvcount,
+                       recvtype,
+                       source,
+                       recvtag,
+                       comm,
+                       status);
+}
+
+/* collectives */
+
+int MPI_Barrier(MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Barrier(comm);
+}
+
+int MPI_Ibarrier(MPI_Comm comm, MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Ibarrier(comm, request);
+}
+
+int MPI_Bcast(
+void* buffer, int count, MPI_Datatype datatype, int root, MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Bcast(buffer, count, datatype, root, comm);
+}
+
+int MPI_Ibcast(void* buffer,
+               int count,
+               MPI_Datatype datatype,
+               int root,
+               MPI_Comm comm,
+               MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Ibcast(buffer, count, datatype, root, comm, request);
+}
+
+int MPI_Reduce(const void* sendbuf,
+               void* recvbuf,
+               int count,
+               MPI_Datatype datatype,
+               MPI_Op op,
+               int root,
+               MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Reduce(sendbuf, recvbuf, count, datatype, op, root, comm);
+}
+
+int MPI_Ireduce(const void* sendbuf,
+                void* recvbuf,
+                int count,
+                MPI_Datatype datatype,
+                MPI_Op op,
+                int root,
+                MPI_Comm comm,
+                MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Ireduce(
+  sendbuf, recvbuf, count, datatype, op, root, comm, request);
+}
+
+int MPI_Allreduce(const void* sendbuf,
+                  void* recvbuf,
+                  int count,
+                  MPI_Datatype datatype,
+                  MPI_Op op,
+                  MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Allreduce(sendbuf, recvbuf, count, datatype, op, comm);
+}
+
+int MPI_Iallreduce(const void* sendbuf,
+                   void* recvbuf,
+                   int count,
+                   MPI_Datatype datatype,
+                   MPI_Op op,
+                   MPI_Comm comm,
+                   MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Iallreduce(
+  sendbuf, recvbuf, count, datatype, op, comm, request);
+}
+
+int MPI_Scan(const void* sendbuf,
+             void* recvbuf,
+             int count,
+             MPI_Datatype datatype,
+             MPI_Op op,
+             MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Scan(sendbuf, recvbuf, count, datatype, op, comm);
+}
+
+int MPI_Iscan(const void* sendbuf,
+              void* recvbuf,
+              int count,
+              MPI_Datatype datatype,
+              MPI_Op op,
+              MPI_Comm comm,
+              MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Iscan(sendbuf, recvbuf, count, datatype, op, comm, request);
+}
+
+int MPI_Exscan(const void* sendbuf,
+               void* recvbuf,
+               int count,
+               MPI_Datatype datatype,
+               MPI_Op op,
+               MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Exscan(sendbuf, recvbuf, count, datatype, op, comm);
+}
+
+int MPI_Iexscan(const void* sendbuf,
+                void* recvbuf,
+                int count,
+                MPI_Datatype datatype,
+                MPI_Op op,
+                MPI_Comm comm,
+                MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Iexscan(sendbuf, recvbuf, count, datatype, op, comm, request);
+}
+
+int MPI_Gather(const void* sendbuf,
+               int sendcount,
+               MPI_Datatype sendtype,
+               void* recvbuf,
+               int recvcount,
+               MPI_Datatype recvtype,
+               int root,
+               MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Gather(
+  sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm);
+}
+
+int MPI_Igather(const void* sendbuf,
+                int sendcount,
+                MPI_Datatype sendtype,
+                void* recvbuf,
+                int recvcount,
+                MPI_Datatype recvtype,
+                int root,
+                MPI_Comm comm,
+                MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Igather(sendbuf,
+                      sendcount,
+                      sendtype,
+                      recvbuf,
+                      recvcount,
+                      recvtype,
+                      root,
+                      comm,
+                      request);
+}
+
+int MPI_Gatherv(const void* sendbuf,
+                int sendcount,
+                MPI_Datatype sendtype,
+                void* recvbuf,
+                const int* recvcounts,
+                const int* displs,
+                MPI_Datatype recvtype,
+                int root,
+                MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Gatherv(sendbuf,
+                      sendcount,
+                      sendtype,
+                      recvbuf,
+                      recvcounts,
+                      displs,
+                      recvtype,
+                      root,
+                      comm);
+}
+
+int MPI_Igatherv(const void* sendbuf,
+                 int sendcount,
+                 MPI_Datatype sendtype,
+                 void* recvbuf,
+                 const int* recvcounts,
+                 const int* displs,
+                 MPI_Datatype recvtype,
+                 int root,
+                 MPI_Comm comm,
+                 MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Igatherv(sendbuf,
+                       sendcount,
+                       sendtype,
+                       recvbuf,
+                       recvcounts,
+                       displs,
+                       recvtype,
+                       root,
+                       comm,
+                       request);
+}
+
+int MPI_Scatter(const void* sendbuf,
+                int sendcount,
+                MPI_Datatype sendtype,
+                void* recvbuf,
+                int recvcount,
+                MPI_Datatype recvtype,
+                int root,
+                MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Scatter(
+  sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, root, comm);
+}
+
+int MPI_Iscatter(const void* sendbuf,
+                 int sendcount,
+                 MPI_Datatype sendtype,
+                 void* recvbuf,
+                 int recvcount,
+                 MPI_Datatype recvtype,
+                 int root,
+                 MPI_Comm comm,
+                 MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Iscatter(sendbuf,
+                       sendcount,
+                       sendtype,
+                       recvbuf,
+                       recvcount,
+                       recvtype,
+                       root,
+                       comm,
+                       request);
+}
+
+int MPI_Scatterv(const void* sendbuf,
+                 const int* sendcounts,
+                 const int* displs,
+                 MPI_Datatype sendtype,
+                 void* recvbuf,
+                 int recvcount,
+                 MPI_Datatype recvtype,
+                 int root,
+                 MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Scatterv(sendbuf,
+                       sendcounts,
+                       displs,
+                       sendtype,
+                       recvbuf,
+                       recvcount,
+                       recvtype,
+                       root,
+                       comm);
+}
+
+int MPI_Iscatterv(const void* sendbuf,
+                  const int* sendcounts,
+                  const int* displs,
+                  MPI_Datatype sendtype,
+                  void* recvbuf,
+                  int recvcount,
+                  MPI_Datatype recvtype,
+                  int root,
+                  MPI_Comm comm,
+                  MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Iscatterv(sendbuf,
+                        sendcounts,
+                        displs,
+                        sendtype,
+                        recvbuf,
+                        recvcount,
+                        recvtype,
+                        root,
+                        comm,
+                        request);
+}
+
+int MPI_Allgather(const void* sendbuf,
+                  int sendcount,
+                  MPI_Datatype sendtype,
+                  void* recvbuf,
+                  int recvcount,
+                  MPI_Datatype recvtype,
+                  MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Allgather(
+  sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+}
+
+int MPI_Iallgather(const void* sendbuf,
+                   int sendcount,
+                   MPI_Datatype sendtype,
+                   void* recvbuf,
+                   int recvcount,
+                   MPI_Datatype recvtype,
+                   MPI_Comm comm,
+                   MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Iallgather(
+  sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm, request);
+}
+
+int MPI_Allgatherv(const void* sendbuf,
+                   int sendcount,
+                   MPI_Datatype sendtype,
+                   void* recvbuf,
+                   const int* recvcounts,
+                   const int* displs,
+                   MPI_Datatype recvtype,
+                   MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Allgatherv(
+  sendbuf, sendcount, sendtype, recvbuf, recvcounts, displs, recvtype, comm);
+}
+
+int MPI_Iallgatherv(const void* sendbuf,
+                    int sendcount,
+                    MPI_Datatype sendtype,
+                    void* recvbuf,
+                    const int* recvcounts,
+                    const int* displs,
+                    MPI_Datatype recvtype,
+                    MPI_Comm comm,
+                    MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Iallgatherv(sendbuf,
+                          sendcount,
+                          sendtype,
+                          recvbuf,
+                          recvcounts,
+                          displs,
+                          recvtype,
+                          comm,
+                          request);
+}
+
+int MPI_Alltoall(const void* sendbuf,
+                 int sendcount,
+                 MPI_Datatype sendtype,
+                 void* recvbuf,
+                 int recvcount,
+                 MPI_Datatype recvtype,
+                 MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Alltoall(
+  sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm);
+}
+
+int MPI_Ialltoall(const void* sendbuf,
+                  int sendcount,
+                  MPI_Datatype sendtype,
+                  void* recvbuf,
+                  int recvcount,
+                  MPI_Datatype recvtype,
+                  MPI_Comm comm,
+                  MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Ialltoall(
+  sendbuf, sendcount, sendtype, recvbuf, recvcount, recvtype, comm, request);
+}
+
+int MPI_Alltoallv(const void* sendbuf,
+                  const int* sendcounts,
+                  const int* sdispls,
+                  MPI_Datatype sendtype,
+                  void* recvbuf,
+                  const int* recvcounts,
+                  const int* rdispls,
+                  MPI_Datatype recvtype,
+                  MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Alltoallv(sendbuf,
+                        sendcounts,
+                        sdispls,
+                        sendtype,
+                        recvbuf,
+                        recvcounts,
+                        rdispls,
+                        recvtype,
+                        comm);
+}
+
+int MPI_Ialltoallv(const void* sendbuf,
+                   const int* sendcounts,
+                   const int* sdispls,
+                   MPI_Datatype sendtype,
+                   void* recvbuf,
+                   const int* recvcounts,
+                   const int* rdispls,
+                   MPI_Datatype recvtype,
+                   MPI_Comm comm,
+                   MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Ialltoallv(sendbuf,
+                         sendcounts,
+                         sdispls,
+                         sendtype,
+                         recvbuf,
+                         recvcounts,
+                         rdispls,
+                         recvtype,
+                         comm,
+                         request);
+}
+
+int MPI_Reduce_scatter(const void* sendbuf,
+                       void* recvbuf,
+                       const int* recvcounts,
+                       MPI_Datatype datatype,
+                       MPI_Op op,
+                       MPI_Comm comm)
+{
+  mpi_test::count_collective();
+  return PMPI_Reduce_scatter(sendbuf, recvbuf, recvcounts, datatype, op, comm);
+}
+
+int MPI_Ireduce_scatter(const void* sendbuf,
+                        void* recvbuf,
+                        const int* recvcounts,
+                        MPI_Datatype datatype,
+                        MPI_Op op,
+                        MPI_Comm comm,
+                        MPI_Request* request)
+{
+  mpi_test::count_collective();
+  return PMPI_Ireduce_scatter(
+  sendbuf, recvbuf, recvcounts, datatype, op, comm, request);
+}